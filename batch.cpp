@@ -0,0 +1,201 @@
+#include "batch.h"
+#include "cpu_lockstep.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <dirent.h>
+#include <sys/stat.h>
+
+batch::batch(uint64_t mem_size, memory::backing b, rv32i_hart::engine e, uint64_t exec_limit)
+	: mem_size(mem_size), backing(b), exec_engine(e), exec_limit(exec_limit)
+{
+}
+
+bool batch::add(const std::string& path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		std::cout << "Can't open '" << path << "'" << std::endl;
+		return false;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR* d = opendir(path.c_str());
+		if (!d) {
+			std::cout << "Can't read directory '" << path << "'" << std::endl;
+			return false;
+		}
+
+		std::vector<std::string> names;
+		while (dirent* e = readdir(d)) {
+			std::string fname = path + "/" + e->d_name;
+			if (stat(fname.c_str(), &st) == 0 && S_ISREG(st.st_mode)) names.push_back(fname);
+		}
+		closedir(d);
+
+		std::sort(names.begin(), names.end());
+		for (const std::string& n : names) jobs.push_back({ n, false, "", 0, 0 });
+		return true;
+	}
+
+	// a list file names one image per line; anything else is an image
+	std::ifstream in(path);
+	std::string line;
+	bool is_list = path.size() > 4 && path.compare(path.size() - 4, 4, ".lst") == 0;
+	if (!is_list) {
+		jobs.push_back({ path, false, "", 0, 0 });
+		return true;
+	}
+	while (std::getline(in, line)) {
+		if (!line.empty()) jobs.push_back({ line, false, "", 0, 0 });
+	}
+	return true;
+}
+
+void batch::run(unsigned threads)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::atomic<size_t> next = { 0 };
+	auto worker = [&] {
+		if (!origin.mem) {
+			for (size_t i; (i = next.fetch_add(1)) < jobs.size();) run_job(jobs[i]);
+			return;
+		}
+		if (lockstep) {
+			run_lockstep(next);
+			return;
+		}
+
+		memory mem(origin.mem, backing);
+		cpu_single_hart cpu(mem);
+		cpu.restore_state(origin.hart);
+		cpu.set_engine(exec_engine);
+		cpu.set_baseline();
+		for (size_t i; (i = next.fetch_add(1)) < jobs.size();) run_fork(jobs[i], cpu, mem);
+	};
+
+	size_t per_thread = origin.mem && lockstep ? cpu_lockstep::lanes : 1;
+	threads = std::max(1u, std::min<unsigned>(threads, (jobs.size() + per_thread - 1) / per_thread));
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+	worker();
+	for (std::thread& t : pool) t.join();
+
+	wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void batch::run_job(job& j) const
+{
+	auto start = std::chrono::steady_clock::now();
+
+	memory mem(mem_size, backing);
+	cpu_single_hart cpu(mem);
+	uint32_t entry;
+	j.loaded = mem.load_image(j.fname, entry);
+	if (j.loaded) {
+		cpu.set_pc(entry);
+		cpu.set_engine(exec_engine);
+		cpu.execute(exec_limit);
+		j.halt_reason = cpu.is_halted() ? cpu.get_halt_reason() : "Execution limit reached";
+		j.insn_counter = cpu.get_insn_counter();
+	}
+	else {
+		j.halt_reason = "Load failed";
+	}
+
+	j.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void batch::run_fork(job& j, cpu_single_hart& cpu, memory& mem) const
+{
+	auto start = std::chrono::steady_clock::now();
+
+	cpu.reset_to_baseline();
+	uint32_t entry;
+	j.loaded = mem.load_image(j.fname, entry);
+	if (j.loaded) {
+		// the image may overwrite code the hart has already decoded
+		cpu.invalidate_icache();
+		cpu.execute(exec_limit);
+		j.halt_reason = cpu.is_halted() ? cpu.get_halt_reason() : "Execution limit reached";
+		j.insn_counter = cpu.get_insn_counter();
+	}
+	else {
+		j.halt_reason = "Load failed";
+	}
+
+	j.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Take jobs lanes at a time, run each group in lock-step, and then let
+// every hart finish on its own once its lane has left. Each job's time is
+// that of its whole group.
+void batch::run_lockstep(std::atomic<size_t>& next)
+{
+	std::vector<std::unique_ptr<memory>> mems;
+	std::vector<std::unique_ptr<cpu_single_hart>> cpus;
+	std::vector<memory*> lane_mems;
+	std::vector<cpu_single_hart*> lane_cpus;
+	for (unsigned l = 0; l < cpu_lockstep::lanes; l++) {
+		mems.push_back(std::make_unique<memory>(origin.mem, backing));
+		cpus.push_back(std::make_unique<cpu_single_hart>(*mems.back()));
+		cpus.back()->restore_state(origin.hart);
+		cpus.back()->set_engine(exec_engine);
+		cpus.back()->set_baseline();
+		lane_mems.push_back(mems.back().get());
+		lane_cpus.push_back(cpus.back().get());
+	}
+
+	cpu_lockstep group;
+	for (size_t first; (first = next.fetch_add(cpu_lockstep::lanes)) < jobs.size();) {
+		auto start = std::chrono::steady_clock::now();
+
+		size_t n = std::min<size_t>(cpu_lockstep::lanes, jobs.size() - first);
+		uint32_t active = 0;
+		for (size_t l = 0; l < n; l++) {
+			job& j = jobs[first + l];
+			cpus[l]->reset_to_baseline();
+			uint32_t entry;
+			j.loaded = mems[l]->load_image(j.fname, entry);
+			if (j.loaded) {
+				cpus[l]->invalidate_icache();
+				active |= 1u << l;
+			}
+			else {
+				j.halt_reason = "Load failed";
+			}
+		}
+
+		group.execute(lane_cpus, lane_mems, active, exec_limit);
+
+		for (size_t l = 0; l < n; l++) {
+			job& j = jobs[first + l];
+			if (!j.loaded) continue;
+			cpus[l]->execute(exec_limit);
+			j.halt_reason = cpus[l]->is_halted() ? cpus[l]->get_halt_reason() : "Execution limit reached";
+			j.insn_counter = cpus[l]->get_insn_counter();
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		for (size_t l = 0; l < n; l++) jobs[first + l].seconds = seconds;
+	}
+}
+
+void batch::report(std::ostream& os) const
+{
+	uint64_t total = 0;
+	size_t failed = 0;
+	for (const job& j : jobs) {
+		os << std::setw(14) << j.insn_counter << " " << std::fixed << std::setprecision(6) << std::setw(10) << j.seconds
+		   << "  " << j.fname << ": " << j.halt_reason << std::endl;
+		total += j.insn_counter;
+		failed += !j.loaded;
+	}
+	os << jobs.size() << " jobs, " << failed << " failed to load, " << total << " instructions executed in "
+	   << std::fixed << std::setprecision(3) << wall_seconds << " seconds" << std::endl;
+}
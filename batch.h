@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <atomic>
+#include "cpu_single_hart.h"
+
+// Runs many independent guest images on a pool of host threads, each job
+// on its own memory and cpu_single_hart, and collects one result per job.
+// Given a snapshot, every job is instead a fork of it with the job's image
+// loaded on top, and continues from the snapshot pc. Each thread makes one
+// fork and resets it to the snapshot between jobs. With lock-step set,
+// each thread makes cpu_lockstep::lanes forks and runs that many jobs at
+// a time in lock-step.
+class batch
+{
+public:
+	struct job
+	{
+		std::string fname;
+		bool loaded = { false };
+		std::string halt_reason;
+		uint64_t insn_counter = { 0 };
+		double seconds = { 0 };
+	};
+
+	batch(uint64_t mem_size, memory::backing b, rv32i_hart::engine e, uint64_t exec_limit);
+	void fork_from(const cpu_single_hart::snapshot& s) { origin = s; }
+	void set_lockstep(bool b) { lockstep = b; }
+
+	// Add an image, every regular file in a directory (in name order), or
+	// every line of a list file. Returns false if path can't be read.
+	bool add(const std::string& path);
+
+	void run(unsigned threads);
+	void report(std::ostream& os) const;
+
+private:
+	void run_job(job& j) const;
+	void run_fork(job& j, cpu_single_hart& cpu, memory& mem) const;
+	void run_lockstep(std::atomic<size_t>& next);
+
+	uint64_t mem_size;
+	memory::backing backing;
+	rv32i_hart::engine exec_engine;
+	uint64_t exec_limit;
+	cpu_single_hart::snapshot origin;
+	bool lockstep = { false };
+
+	std::vector<job> jobs;
+	double wall_seconds = { 0 };
+};
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include "cache_model.h"
+
+static bool is_pow2(uint64_t n) { return n && !(n & (n - 1)); }
+
+bool cache_model::parse(const std::string& spec, config& c)
+{
+	std::vector<std::string> fields;
+	std::stringstream ss(spec);
+	for (std::string f; std::getline(ss, f, ':'); ) fields.push_back(f);
+	if (fields.empty() || fields.size() > 4) {
+		std::cout << "Bad cache '" << spec << "': want size[:ways[:line[:policy]]]" << std::endl;
+		return false;
+	}
+
+	try {
+		size_t end;
+		uint64_t size = std::stoull(fields[0], &end);
+		std::string suffix = fields[0].substr(end);
+		if (suffix == "k" || suffix == "K") size <<= 10;
+		else if (suffix == "m" || suffix == "M") size <<= 20;
+		else if (!suffix.empty()) throw std::invalid_argument(suffix);
+		if (size > 1u << 31) throw std::out_of_range(fields[0]);
+		c.size = size;
+		if (fields.size() > 1) c.ways = std::stoul(fields[1]);
+		if (fields.size() > 2) c.line = std::stoul(fields[2]);
+	}
+	catch (const std::exception&) {
+		std::cout << "Bad cache '" << spec << "': sizes are numbers" << std::endl;
+		return false;
+	}
+	if (fields.size() > 3) {
+		if (fields[3] == "lru") c.replace = policy::lru;
+		else if (fields[3] == "fifo") c.replace = policy::fifo;
+		else if (fields[3] == "random") c.replace = policy::random;
+		else {
+			std::cout << "Bad cache '" << spec << "': policy is lru, fifo or random" << std::endl;
+			return false;
+		}
+	}
+
+	if (!is_pow2(c.line) || c.line < 4 || !c.ways || c.size % (uint64_t(c.ways) * c.line)
+	    || !is_pow2(c.size / (uint64_t(c.ways) * c.line))) {
+		std::cout << "Bad cache '" << spec << "': line must be a power of two of at least 4, and size / (ways * line)"
+			" a power of two" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+cache_model::cache_model(const config& c) : cfg(c), ways(c.ways), replace(c.replace)
+{
+	line_shift = __builtin_ctz(c.line);
+	uint32_t sets = c.size / (c.ways * c.line);
+	set_mask = sets - 1;
+	tags.assign(size_t(sets) * ways, invalid);
+	ages.assign(tags.size(), 0);
+	dirty.assign(tags.size(), 0);
+}
+
+// A miss: fill an empty way if there is one, otherwise replace
+void cache_model::fill(size_t base, uint32_t line, bool write)
+{
+	misses++;
+	size_t victim = base + ways;
+	for (uint32_t w = 0; w < ways; w++) {
+		if (tags[base + w] == invalid) {
+			victim = base + w;
+			break;
+		}
+	}
+	if (victim == base + ways) {
+		if (replace == policy::random) {
+			rng ^= rng << 13;
+			rng ^= rng >> 17;
+			rng ^= rng << 5;
+			victim = base + rng % ways;
+		}
+		else {
+			victim = base;
+			for (uint32_t w = 1; w < ways; w++) {
+				if (ages[base + w] < ages[victim]) victim = base + w;
+			}
+		}
+		evictions++;
+		writebacks += dirty[victim];
+	}
+
+	tags[victim] = line;
+	ages[victim] = ++clock;
+	dirty[victim] = write;
+}
+
+void cache_model::report(std::ostream& os, const std::string& name) const
+{
+	static const char* const policies[] = { "lru", "fifo", "random" };
+	uint64_t accesses = hits + misses;
+	std::ios_base::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+
+	os << name << cfg.size << " bytes, " << cfg.ways << " ways, " << cfg.line << " byte lines, "
+		<< policies[size_t(cfg.replace)] << std::endl;
+	os << name << accesses << " accesses, " << hits << " hits, " << misses << " misses ("
+		<< std::fixed << std::setprecision(2) << (accesses ? 100.0 * misses / accesses : 0.0) << "%)" << std::endl;
+	os << name << evictions << " evictions, " << writebacks << " writebacks" << std::endl;
+
+	os.flags(flags);
+	os.precision(precision);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+// A set-associative cache model that counts hits, misses, evictions and
+// dirty writebacks; it holds no data. Stores allocate and are written back
+// on eviction. Each way's tag, age and dirty bit are in arrays of their
+// own, with a set's ways next to each other, so a lookup compares a few
+// contiguous words. Replacement picks the least recently used way, the
+// oldest filled, or a random one.
+class cache_model
+{
+public:
+	enum class policy : uint8_t { lru, fifo, random };
+
+	struct config
+	{
+		uint32_t size = { 32 * 1024 };
+		uint32_t ways = { 4 };
+		uint32_t line = { 64 };
+		policy replace = { policy::lru };
+	};
+
+	// spec is size[:ways[:line[:lru|fifo|random]]], size in bytes with an
+	// optional k or m suffix. line and the number of sets must be powers of
+	// two. Returns false, saying why, if spec is not a cache.
+	static bool parse(const std::string& spec, config& c);
+
+	explicit cache_model(const config& c);
+
+	// An access that straddles two lines looks up both
+	void access(uint32_t addr, uint32_t len, bool write)
+	{
+		uint32_t first = addr >> line_shift;
+		uint32_t last = uint32_t(uint64_t(addr) + len - 1) >> line_shift;
+		lookup(first, write);
+		if (last != first) lookup(last, write);
+	}
+
+	// One line for each of the counts, each starting with name
+	void report(std::ostream& os, const std::string& name) const;
+
+private:
+	static constexpr uint32_t invalid = 0xffffffff;
+
+	void lookup(uint32_t line, bool write)
+	{
+		size_t base = size_t(line & set_mask) * ways;
+		for (uint32_t w = 0; w < ways; w++) {
+			if (tags[base + w] == line) {
+				hits++;
+				if (replace == policy::lru) ages[base + w] = ++clock;
+				dirty[base + w] |= write;
+				return;
+			}
+		}
+		fill(base, line, write);
+	}
+	void fill(size_t base, uint32_t line, bool write);
+
+	config cfg;
+	uint32_t ways;
+	uint32_t line_shift;
+	uint32_t set_mask;
+	policy replace;
+
+	// lines (address / line size), invalid when empty
+	std::vector<uint32_t> tags;
+	// clock at the last use (lru) or the fill (fifo)
+	std::vector<uint64_t> ages;
+	std::vector<uint8_t> dirty;
+	uint64_t clock = { 0 };
+	uint32_t rng = { 0x2545f491 };
+
+	uint64_t hits = { 0 };
+	uint64_t misses = { 0 };
+	uint64_t evictions = { 0 };
+	uint64_t writebacks = { 0 };
+};
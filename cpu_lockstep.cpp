@@ -0,0 +1,244 @@
+#include <algorithm>
+#include "cpu_lockstep.h"
+
+cpu_lockstep::cpu_lockstep() : cache(cache_size), code_pages(size_t(1) << (32 - code_page_shift))
+{
+}
+
+void cpu_lockstep::execute(const std::vector<cpu_single_hart*>& cpus, const std::vector<memory*>& mems, uint32_t active,
+	uint64_t exec_limit)
+{
+	this->cpus = cpus;
+	this->mems = mems;
+	this->active = active & ((1u << std::min<size_t>(cpus.size(), lanes)) - 1);
+	flush();
+	if (!this->active) return;
+
+	rv32i_hart::state s = cpus[__builtin_ctz(this->active)]->save_state();
+	pc = s.pc;
+	insn_counter = s.insn_counter;
+	for (uint32_t m = this->active; m; m &= m - 1) {
+		unsigned l = __builtin_ctz(m);
+		s = cpus[l]->save_state();
+		if (s.halt || s.pc != pc || s.insn_counter != insn_counter) {
+			this->active &= ~(1u << l);
+			continue;
+		}
+		for (uint32_t r = 0; r < 32; r++) x[r][l] = s.regs.get(r);
+	}
+
+	run(exec_limit);
+	split(this->active);
+}
+
+// Every vector operation in here is on all lanes at once. Lanes that are
+// no longer active compute garbage, which is never looked at.
+__attribute__((target_clones("avx2", "default"))) void cpu_lockstep::run(uint64_t exec_limit)
+{
+	auto mask = [this](const svec& c) {
+		uint32_t m = 0;
+		for (unsigned l = 0; l < lanes; l++) m |= (c[l] & 1) << l;
+		return m & active;
+	};
+
+	while (active && (exec_limit == 0 || insn_counter < exec_limit)) {
+		const entry* e = fetch();
+		if (!e) break;
+
+		const uvec& a = x[e->rs1];
+		const uvec& b = x[e->rs2];
+		const uint32_t imm = e->imm;
+		uint32_t next = pc + e->len;
+
+		// the larger group stays in lock-step
+		auto branch = [&](uint32_t taken) {
+			if (taken && taken != active) {
+				split(__builtin_popcount(taken) * 2 >= __builtin_popcount(active) ? active & ~taken : taken);
+				taken &= active;
+			}
+			if (taken) next = pc + imm;
+		};
+		auto load = [&](auto get, uint32_t len) {
+			uvec addr = a + imm;
+			split(out_of_range(addr, len));
+			uvec v = {};
+			for (uint32_t m = active; m; m &= m - 1) {
+				unsigned l = __builtin_ctz(m);
+				v[l] = get(*mems[l], addr[l]);
+			}
+			set(e->rd, v);
+		};
+		auto store = [&](auto put, uint32_t len) {
+			uvec addr = a + imm;
+			split(out_of_range(addr, len));
+			bool code = false;
+			for (uint32_t m = active; m; m &= m - 1) {
+				unsigned l = __builtin_ctz(m);
+				put(*mems[l], addr[l], b[l]);
+				code |= code_pages[addr[l] >> code_page_shift] || code_pages[(addr[l] + len - 1) >> code_page_shift];
+			}
+			if (code) flush();
+		};
+		auto lanewise = [&](auto f) {
+			uvec v;
+			for (unsigned l = 0; l < lanes; l++) v[l] = f(a[l], b[l]);
+			set(e->rd, v);
+		};
+
+		switch (e->o) {
+		case op::lui: set(e->rd, uvec{} + imm); break;
+		case op::auipc: set(e->rd, uvec{} + (pc + imm)); break;
+		case op::jal: set(e->rd, uvec{} + next); next = pc + imm; break;
+		case op::jalr: {
+			uvec t = (a + imm) & ~1u;
+			uint32_t target = t[__builtin_ctz(active)];
+			split(mask(t != target));
+			set(e->rd, uvec{} + next);
+			next = target;
+			break;
+		}
+
+		case op::beq: branch(mask(a == b)); break;
+		case op::bne: branch(mask(a != b)); break;
+		case op::blt: branch(mask((svec)a < (svec)b)); break;
+		case op::bge: branch(mask((svec)a >= (svec)b)); break;
+		case op::bltu: branch(mask(a < b)); break;
+		case op::bgeu: branch(mask(a >= b)); break;
+
+		case op::lb: load([](memory& m, uint32_t addr) { return m.get8_sx(addr); }, 1); break;
+		case op::lh: load([](memory& m, uint32_t addr) { return m.get16_sx(addr); }, 2); break;
+		case op::lw: load([](memory& m, uint32_t addr) { return m.get32(addr); }, 4); break;
+		case op::lbu: load([](memory& m, uint32_t addr) { return m.get8(addr); }, 1); break;
+		case op::lhu: load([](memory& m, uint32_t addr) { return m.get16(addr); }, 2); break;
+
+		case op::sb: store([](memory& m, uint32_t addr, uint32_t v) { m.set8(addr, v); }, 1); break;
+		case op::sh: store([](memory& m, uint32_t addr, uint32_t v) { m.set16(addr, v); }, 2); break;
+		case op::sw: store([](memory& m, uint32_t addr, uint32_t v) { m.set32(addr, v); }, 4); break;
+
+		case op::addi: set(e->rd, a + imm); break;
+		case op::slti: set(e->rd, (uvec)((svec)a < int32_t(imm)) & 1); break;
+		case op::sltiu: set(e->rd, (uvec)(a < imm) & 1); break;
+		case op::xori: set(e->rd, a ^ imm); break;
+		case op::ori: set(e->rd, a | imm); break;
+		case op::andi: set(e->rd, a & imm); break;
+		case op::slli: set(e->rd, a << imm); break;
+		case op::srli: set(e->rd, a >> imm); break;
+		case op::srai: set(e->rd, (uvec)((svec)a >> int32_t(imm))); break;
+
+		case op::add: set(e->rd, a + b); break;
+		case op::sub: set(e->rd, a - b); break;
+		case op::sll: set(e->rd, a << (b & 31)); break;
+		case op::slt: set(e->rd, (uvec)((svec)a < (svec)b) & 1); break;
+		case op::sltu: set(e->rd, (uvec)(a < b) & 1); break;
+		case op::xor_: set(e->rd, a ^ b); break;
+		case op::srl: set(e->rd, a >> (b & 31)); break;
+		case op::sra: set(e->rd, (uvec)((svec)a >> (svec)(b & 31))); break;
+		case op::or_: set(e->rd, a | b); break;
+		case op::and_: set(e->rd, a & b); break;
+
+		// as rv32i_hart, including division by zero and overflow
+		case op::mul: set(e->rd, a * b); break;
+		case op::mulh: lanewise([](uint32_t s, uint32_t t) { return uint32_t((int64_t(int32_t(s)) * int32_t(t)) >> 32); }); break;
+		case op::mulhsu: lanewise([](uint32_t s, uint32_t t) { return uint32_t((int64_t(int32_t(s)) * int64_t(t)) >> 32); }); break;
+		case op::mulhu: lanewise([](uint32_t s, uint32_t t) { return uint32_t((uint64_t(s) * t) >> 32); }); break;
+		case op::div:
+			lanewise([](uint32_t s, uint32_t t) {
+				if (t == 0) return 0xffffffffu;
+				if (s == 0x80000000 && t == 0xffffffff) return s;
+				return uint32_t(int32_t(s) / int32_t(t));
+			});
+			break;
+		case op::divu: lanewise([](uint32_t s, uint32_t t) { return t ? s / t : 0xffffffffu; }); break;
+		case op::rem:
+			lanewise([](uint32_t s, uint32_t t) {
+				if (t == 0) return s;
+				if (s == 0x80000000 && t == 0xffffffff) return 0u;
+				return uint32_t(int32_t(s) % int32_t(t));
+			});
+			break;
+		case op::remu: lanewise([](uint32_t s, uint32_t t) { return t ? s % t : s; }); break;
+
+		// each lane is alone on its memory
+		case op::fence: break;
+
+		default:
+			split(active);
+			continue;
+		}
+
+		pc = next;
+		insn_counter++;
+	}
+}
+
+// The decoded instruction at pc. Lanes that hold a different one there
+// are split off first. nullptr once no lane is left.
+const cpu_lockstep::entry* cpu_lockstep::fetch()
+{
+	entry& e = cache[(pc >> 1) & (cache_size - 1)];
+	if (e.addr == pc) return &e;
+
+	// let the harts deal with fetching out of range
+	if (uint64_t(pc) + 4 > mems[__builtin_ctz(active)]->get_size()) {
+		split(active);
+		return nullptr;
+	}
+
+	uint32_t insn = 0;
+	uint32_t differ = 0;
+	for (uint32_t m = active; m; m &= m - 1) {
+		unsigned l = __builtin_ctz(m);
+		uint32_t w = mems[l]->get16(pc);
+		if (!is_compressed(w)) w |= uint32_t(mems[l]->get16(pc + 2)) << 16;
+		if (m == active) insn = w;
+		else if (w != insn) differ |= 1u << l;
+	}
+	split(differ);
+
+	uint32_t word = is_compressed(insn) ? expand_compressed(insn) : insn;
+	e.o = word ? get_op(word) : op::illegal;
+	e.insn = insn;
+	e.imm = get_imm(word, e.o);
+	e.rd = get_rd(word);
+	e.rs1 = get_rs1(word);
+	e.rs2 = get_rs2(word);
+	e.len = is_compressed(insn) ? 2 : 4;
+	e.addr = pc;
+	code_pages[pc >> code_page_shift] = true;
+	code_pages[(pc + e.len - 1) >> code_page_shift] = true;
+	return &e;
+}
+
+// Hand the lanes in m back to their harts, about to execute the
+// instruction at pc.
+void cpu_lockstep::split(uint32_t m)
+{
+	m &= active;
+	active &= ~m;
+	for (; m; m &= m - 1) {
+		unsigned l = __builtin_ctz(m);
+		rv32i_hart::state s = cpus[l]->save_state();
+		for (uint32_t r = 1; r < 32; r++) s.regs.set(r, x[r][l]);
+		s.pc = pc;
+		s.insn_counter = insn_counter;
+		cpus[l]->restore_state(s);
+		// stores made here went around the hart's icache
+		cpus[l]->invalidate_icache();
+	}
+}
+
+void cpu_lockstep::flush()
+{
+	for (entry& e : cache) e.addr = 0xffffffff;
+	std::fill(code_pages.begin(), code_pages.end(), false);
+}
+
+uint32_t cpu_lockstep::out_of_range(const uvec& addr, uint32_t len) const
+{
+	uint32_t m = 0;
+	for (uint32_t a = active; a; a &= a - 1) {
+		unsigned l = __builtin_ctz(a);
+		if (uint64_t(addr[l]) + len > mems[l]->get_size()) m |= 1u << l;
+	}
+	return m;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "cpu_single_hart.h"
+
+// Runs up to lanes forks of one machine in lock-step: one fetch and
+// decode per instruction for all of them, with the register files held
+// structure-of-arrays so that an ALU instruction is one vector operation
+// across the lanes (AVX2 where the host has it). Each lane has its own
+// memory, so loads and stores are done lane by lane.
+//
+// A lane leaves lock-step, and is handed back to its cpu_single_hart to
+// carry on alone, when it fetches a different instruction from the
+// others, goes the other way at a branch or jalr (the larger group stays),
+// or would access memory out of range. Everyone leaves at an instruction
+// this engine does not run: ecall, ebreak, CSR, fence.i, atomics and
+// illegal ones. The hart then executes that instruction itself. Lanes
+// never rejoin.
+class cpu_lockstep : public rv32i_decode
+{
+public:
+	static constexpr unsigned lanes = 8;
+
+	cpu_lockstep();
+
+	// Run lane l as cpus[l] on mems[l], for every lane set in active. All
+	// of them must be at the same pc and instruction count, as forks of
+	// one snapshot are; any that are not are handed back at once. Returns
+	// with every lane's state back in its hart, which has not executed
+	// anything yet, and stopped if exec_limit (0 = no limit) was reached.
+	void execute(const std::vector<cpu_single_hart*>& cpus, const std::vector<memory*>& mems, uint32_t active,
+		uint64_t exec_limit);
+
+private:
+	typedef uint32_t uvec __attribute__((vector_size(4 * lanes)));
+	typedef int32_t svec __attribute__((vector_size(4 * lanes)));
+
+	struct entry
+	{
+		uint32_t addr = { 0xffffffff };
+		uint32_t insn;
+		int32_t imm;
+		op o;
+		uint8_t rd;
+		uint8_t rs1;
+		uint8_t rs2;
+		uint8_t len;
+	};
+
+	static constexpr uint32_t cache_size = 1 << 12;
+	static constexpr uint32_t code_page_shift = 12;
+
+	void run(uint64_t exec_limit);
+	const entry* fetch();
+	void split(uint32_t m);
+	void flush();
+	// lanes in active whose access of len bytes at addr[l] is out of range
+	uint32_t out_of_range(const uvec& addr, uint32_t len) const;
+	void set(uint32_t r, const uvec& v) { if (r) x[r] = v; }
+
+	std::vector<cpu_single_hart*> cpus;
+	std::vector<memory*> mems;
+	uint32_t active;
+	uint32_t pc;
+	uint64_t insn_counter;
+
+	uvec x[32];
+
+	// decoded instructions, tagged by pc and indexed by halfword, and the
+	// pages they were fetched from
+	std::vector<entry> cache;
+	std::vector<bool> code_pages;
+};
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "cpu_multi_hart.h"
+
+cpu_multi_hart::cpu_multi_hart(memory& mem, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		harts.push_back(std::make_unique<cpu_single_hart>(mem));
+		harts.back()->set_mhartid(i);
+	}
+}
+
+void cpu_multi_hart::set_pc(uint32_t addr)
+{
+	for (auto& h : harts) h->set_pc(addr);
+}
+
+void cpu_multi_hart::set_engine(rv32i_hart::engine e)
+{
+	for (auto& h : harts) h->set_engine(e);
+}
+
+void cpu_multi_hart::set_show_instructions(bool b)
+{
+	for (auto& h : harts) h->set_show_instructions(b);
+}
+
+void cpu_multi_hart::set_show_registers(bool b)
+{
+	for (auto& h : harts) h->set_show_registers(b);
+}
+
+// Hart i logs to fname.i
+bool cpu_multi_hart::set_trace_file(const std::string& fname)
+{
+	for (auto& h : harts) {
+		if (!h->set_trace_file(fname + "." + std::to_string(h->get_mhartid()))) return false;
+	}
+	return true;
+}
+
+// Hart i logs to fname.i
+bool cpu_multi_hart::set_flow_file(const std::string& fname)
+{
+	for (auto& h : harts) {
+		if (!h->set_flow_file(fname + "." + std::to_string(h->get_mhartid()))) return false;
+	}
+	return true;
+}
+
+// Hart i writes fname.i
+bool cpu_multi_hart::set_stack_file(const std::string& fname, uint64_t interval)
+{
+	for (auto& h : harts) {
+		if (!h->set_stack_file(fname + "." + std::to_string(h->get_mhartid()), interval)) return false;
+	}
+	return true;
+}
+
+// Each hart has caches of its own
+void cpu_multi_hart::set_cache_models(const cache_model::config* i, const cache_model::config* d)
+{
+	for (auto& h : harts) h->set_cache_models(i, d);
+}
+
+void cpu_multi_hart::set_profile(bool b)
+{
+	for (auto& h : harts) h->set_profile(b);
+}
+
+// Hart i writes fname.i
+bool cpu_multi_hart::annotate_profile(const std::string& fname,
+	const std::vector<std::shared_ptr<const rv32i_predecode>>& code) const
+{
+	for (auto& h : harts) {
+		if (!h->annotate_profile(fname + "." + std::to_string(h->get_mhartid()), code)) return false;
+	}
+	return true;
+}
+
+void cpu_multi_hart::set_predecoded(const std::vector<std::shared_ptr<const rv32i_predecode>>& p)
+{
+	for (auto& h : harts) h->set_predecoded(p);
+}
+
+// Run every hart until one halts or each has reached exec_limit (0 = no
+// limit). Harts run in slices so that they notice when another has halted.
+void cpu_multi_hart::run(uint64_t exec_limit)
+{
+	std::atomic<bool> stop = { false };
+	auto worker = [&](cpu_single_hart& h) {
+		while (!stop.load(std::memory_order_relaxed) && !h.is_halted()
+		       && (exec_limit == 0 || h.get_insn_counter() < exec_limit)) {
+			uint64_t limit = h.get_insn_counter() + slice;
+			if (exec_limit) limit = std::min(limit, exec_limit);
+			h.execute(limit);
+		}
+		if (h.is_halted()) stop = true;
+	};
+
+	std::vector<std::thread> threads;
+	for (auto& h : harts) threads.emplace_back(worker, std::ref(*h));
+	for (std::thread& t : threads) t.join();
+
+	uint64_t total = 0;
+	for (auto& h : harts) {
+		std::cout << "Hart " << h->get_mhartid() << " terminated. Reason: " << h->get_halt_reason() << std::endl;
+		std::cout << "Hart " << h->get_mhartid() << ": " << h->get_insn_counter() << " instructions executed" << std::endl;
+		h->report_profile(std::cout, "Hart " + std::to_string(h->get_mhartid()) + ": ");
+		total += h->get_insn_counter();
+	}
+	std::cout << total << " instructions executed" << std::endl;
+}
+
+void cpu_multi_hart::dump() const
+{
+	for (auto& h : harts) h->dump("h" + std::to_string(h->get_mhartid()) + " ");
+}
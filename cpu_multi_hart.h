@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include "cpu_single_hart.h"
+
+// N harts sharing one memory, each run on its own host thread. Hart i
+// reads i from mhartid. All harts start at the same pc with sp at the top
+// of memory, and firmware sets up per-hart stacks from mhartid as it would
+// on hardware. Once any hart halts the others stop within slice
+// instructions.
+//
+// Memory ordering: harts access guest memory with plain host loads and
+// stores, so naturally aligned accesses of up to a word are single-copy
+// atomic and other harts observe them in host order (TSO on x86-64).
+// fence is a full host fence, which is at least as strong as any RVWMO
+// fence, so code that is correct under RVWMO is correct here. Instruction
+// fetch is not coherent with other harts' stores: code written by another
+// hart must be followed by a fence.i on the hart that runs it.
+class cpu_multi_hart
+{
+public:
+	cpu_multi_hart(memory& mem, unsigned n);
+
+	void set_pc(uint32_t addr);
+	void set_engine(rv32i_hart::engine e);
+	void set_show_instructions(bool b);
+	void set_show_registers(bool b);
+	bool set_trace_file(const std::string& fname);
+	bool set_flow_file(const std::string& fname);
+	void set_profile(bool b);
+	void set_cache_models(const cache_model::config* i, const cache_model::config* d);
+	bool set_stack_file(const std::string& fname, uint64_t interval);
+	bool annotate_profile(const std::string& fname, const std::vector<std::shared_ptr<const rv32i_predecode>>& code) const;
+	void set_predecoded(const std::vector<std::shared_ptr<const rv32i_predecode>>& p);
+
+	void run(uint64_t exec_limit);
+	void dump() const;
+
+private:
+	static constexpr uint64_t slice = 1 << 16;
+
+	std::vector<std::unique_ptr<cpu_single_hart>> harts;
+};
@@ -1,16 +1,79 @@
 #include <iostream>
+#include <fstream>
+#include <csetjmp>
 #include "cpu_single_hart.h"
 
 void cpu_single_hart::run(uint64_t exec_limit)
 {
-	regs.set(2, mem.get_size());
+	execute(exec_limit);
 
-
-	while (!is_halted() && (exec_limit == 0 || get_insn_counter() < exec_limit)) {
-		tick();
-	}
-	
 	std::cout << "Execution terminated. Reason: " << get_halt_reason() << std::endl;
 	std::cout << get_insn_counter() << " instructions executed" << std::endl;
+	report_profile(std::cout);
+}
+
+void cpu_single_hart::report_profile(std::ostream& os, const std::string& hdr) const
+{
+	if (const profile* p = get_profile()) p->report(os, mem, hdr);
+	if (const cache_model* c = get_l1i()) c->report(os, hdr + "L1I: ");
+	if (const cache_model* c = get_l1d()) c->report(os, hdr + "L1D: ");
+}
+
+bool cpu_single_hart::annotate_profile(const std::string& fname,
+	const std::vector<std::shared_ptr<const rv32i_predecode>>& code) const
+{
+	const profile* p = get_profile();
+	if (!p) return true;
+	std::ofstream os(fname);
+	if (!os) {
+		std::cout << "Can't open file '" << fname << "' for writing" << std::endl;
+		return false;
+	}
+	for (const auto& r : code) p->annotate(os, mem, r->get_start(), r->get_end() - r->get_start());
+	return true;
 }
 
+// Run until the hart halts or exec_limit (0 = no limit) is reached.
+void cpu_single_hart::execute(uint64_t exec_limit)
+{
+	// With reserved memory an out of range load or store lands here, with
+	// pc at the faulting instruction. Native code leaves such an access to
+	// exec_block() or the interpreter, and exec_block() counts instructions
+	// only at the end of a block, so count those that ran before the fault.
+	sigjmp_buf fault;
+	if (sigsetjmp(fault, 1) == 0) {
+		memory::catch_faults(&fault);
+
+		if (!show_instructions && !show_registers && !insn_log && !l1i && !l1d) {
+			if (exec_engine == engine::threaded) run_blocks(exec_limit);
+			else if (exec_engine == engine::jit) run_jit(exec_limit);
+		}
+
+		interpret(exec_limit);
+	}
+	else {
+		count_faulted_block();
+		halt_hart("Memory access fault at " + hex::to_hex0x32(memory::get_fault_addr()));
+	}
+	memory::catch_faults(nullptr);
+}
+
+
+void cpu_single_hart::set_baseline()
+{
+	mem.set_baseline();
+	baseline = save_state();
+}
+
+// Rather than flush every decoded instruction, drop those in the pages
+// that are about to change back, unless that would touch more entries.
+void cpu_single_hart::reset_to_baseline()
+{
+	const std::vector<uint32_t>& dirty = mem.get_dirty_pages();
+	if (dirty.size() * memory::page_size / 2 > icache_size) invalidate_icache();
+	else {
+		for (uint32_t page : dirty) invalidate_icache(page << memory::page_shift, memory::page_size);
+	}
+	mem.reset_to_baseline();
+	restore_state(baseline);
+}
@@ -1,10 +1,36 @@
 #pragma once
+#include <memory>
 #include "rv32i_hart.h"
 
 class cpu_single_hart : public rv32i_hart
 {
 public:
-	cpu_single_hart(memory& mem) : rv32i_hart(mem) {}
+	// The whole machine at one point. To fork it, make a memory from mem
+	// and restore hart on a cpu_single_hart running on that memory.
+	struct snapshot
+	{
+		std::shared_ptr<const memory::snapshot> mem;
+		state hart;
+	};
+
+	// a full 4 GiB memory wraps sp to 0, which is still the top of memory
+	cpu_single_hart(memory& mem) : rv32i_hart(mem) { regs.set(2, uint32_t(mem.get_size())); }
 	void run(uint64_t exec_limit);
+	void execute(uint64_t exec_limit);
+	// With profiling on, the profile report, and the code in the ranges of
+	// code with each instruction's count written to fname. The report
+	// includes the cache models' counts.
+	void report_profile(std::ostream& os, const std::string& hdr = "") const;
+	bool annotate_profile(const std::string& fname, const std::vector<std::shared_ptr<const rv32i_predecode>>& code) const;
+	snapshot take_snapshot() const { return { mem.take_snapshot(), save_state() }; }
+
+	// Fast reset for fuzzing: set_baseline() marks the current memory and
+	// hart state, and reset_to_baseline() returns to it in time
+	// proportional to the pages written since.
+	void set_baseline();
+	void reset_to_baseline();
+
+private:
+	state baseline;
 };
 
@@ -0,0 +1,176 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include "flow_trace.h"
+#include "memory.h"
+
+flow_trace::flow_trace(const std::string& fname, uint32_t start_pc)
+{
+	f = std::fopen(fname.c_str(), "wb");
+	if (!f) {
+		std::cout << "Can't open file '" << fname << "' for writing" << std::endl;
+		return;
+	}
+	buf.reserve(flush_size + 16);
+	put(magic, sizeof(magic));
+	uint8_t pc[4] = { uint8_t(start_pc), uint8_t(start_pc >> 8), uint8_t(start_pc >> 16), uint8_t(start_pc >> 24) };
+	put(pc, sizeof(pc));
+}
+
+flow_trace::~flow_trace()
+{
+	if (!f) return;
+	if (nbits) put_bits();
+	flush();
+	std::fclose(f);
+}
+
+void flow_trace::finish(uint64_t insns)
+{
+	if (finished) return;
+	if (nbits) put_bits();
+	uint8_t p[9] = { end_packet };
+	for (int i = 0; i < 8; i++) p[1 + i] = uint8_t(insns >> 8 * i);
+	put(p, sizeof(p));
+	finished = true;
+}
+
+void flow_trace::put_bits()
+{
+	uint8_t p[9] = { uint8_t(nbits) };
+	for (unsigned i = 0; i < (nbits + 7) / 8; i++) p[1 + i] = uint8_t(bits >> 8 * i);
+	put(p, 1 + (nbits + 7) / 8);
+	bits = 0;
+	nbits = 0;
+}
+
+void flow_trace::put_target(uint32_t target)
+{
+	uint32_t diff = target ^ last_target;
+	unsigned k = diff ? 4 - __builtin_clz(diff) / 8 : 0;
+	uint8_t p[5] = { uint8_t(target_packet + k) };
+	for (unsigned i = 0; i < k; i++) p[1 + i] = uint8_t(target >> 8 * i);
+	put(p, 1 + k);
+	last_target = target;
+}
+
+void flow_trace::put(const void* p, size_t n)
+{
+	const uint8_t* b = static_cast<const uint8_t*>(p);
+	buf.insert(buf.end(), b, b + n);
+	if (buf.size() >= flush_size) flush();
+}
+
+void flow_trace::flush()
+{
+	std::fwrite(buf.data(), 1, buf.size(), f);
+	buf.clear();
+}
+
+bool flow_trace::replay(const std::string& fname, const memory& mem, std::ostream& os)
+{
+	std::ifstream in(fname, std::ios::binary);
+	if (!in) {
+		std::cout << "Can't open file '" << fname << "' for reading" << std::endl;
+		return false;
+	}
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (data.size() < sizeof(magic) + 4 || std::memcmp(data.data(), magic, sizeof(magic)) != 0) {
+		std::cout << "'" << fname << "' is not a flow trace" << std::endl;
+		return false;
+	}
+	auto get_le = [&](size_t at, unsigned n) {
+		uint64_t v = 0;
+		for (unsigned i = 0; i < n; i++) v |= uint64_t(data[at + i]) << 8 * i;
+		return v;
+	};
+	uint32_t pc = get_le(sizeof(magic), 4);
+	size_t at = sizeof(magic) + 4;
+
+	// Walk the packet boundaries to the end packet. Without one the run did
+	// not finish, and what there is up to the last whole packet is replayed.
+	uint64_t count = UINT64_MAX;
+	size_t end = at;
+	while (end < data.size()) {
+		uint8_t type = data[end];
+		size_t len;
+		if (type >= 1 && type <= 64) len = 1 + (type + 7) / 8;
+		else if (type >= target_packet && type <= target_packet + 4) len = 1 + type - target_packet;
+		else if (type == end_packet) len = 9;
+		else {
+			std::cout << "'" << fname << "' has a bad packet at offset " << end << std::endl;
+			return false;
+		}
+		if (end + len > data.size()) break;
+		if (type == end_packet) {
+			count = get_le(end + 1, 8);
+			break;
+		}
+		end += len;
+	}
+
+	uint64_t bits = 0;
+	unsigned nbits = 0;
+	uint32_t target = 0;
+	// the next packet, if it is of the kind wanted
+	auto next_bits = [&]() {
+		if (at == end || data[at] < 1 || data[at] > 64) return false;
+		unsigned n = data[at], bytes = (n + 7) / 8;
+		if (at + 1 + bytes > end) return false;
+		bits = get_le(at + 1, bytes);
+		nbits = n;
+		at += 1 + bytes;
+		return true;
+	};
+	auto next_target = [&]() {
+		if (nbits || at == end || data[at] < target_packet || data[at] > target_packet + 4) return false;
+		unsigned k = data[at] - target_packet;
+		if (at + 1 + k > end) return false;
+		uint32_t mask = k == 4 ? 0xffffffff : (1u << 8 * k) - 1;
+		target = (target & ~mask) | uint32_t(get_le(at + 1, k));
+		at += 1 + k;
+		return true;
+	};
+
+	std::vector<char> out(1 << 16);
+	text_buffer text(out.data(), out.size());
+	uint64_t n = 0;
+	for (; n < count && uint64_t(pc) + 4 <= mem.get_size(); n++) {
+		uint32_t insn = mem.get16(pc);
+		if (!is_compressed(insn)) insn |= uint32_t(mem.get16(pc + 2)) << 16;
+		uint32_t word = is_compressed(insn) ? expand_compressed(insn) : insn;
+		op o = word ? get_op(word) : op::illegal;
+		uint32_t next = pc + (is_compressed(insn) ? 2 : 4);
+		if (o >= op::beq && o <= op::bgeu) {
+			if (!nbits && !next_bits()) break;
+			if (bits & 1) next = pc + get_imm(word, o);
+			bits >>= 1;
+			nbits--;
+		}
+		else if (o == op::jal) next = pc + get_imm(word, o);
+		else if (o == op::jalr) {
+			if (!next_target()) break;
+			next = target;
+		}
+
+		text << hex32(pc) << ": ";
+		if (is_compressed(insn)) text << "    " << hex16(insn);
+		else text << hex32(insn);
+		text << "  ";
+		decode(text, pc, insn);
+		text << '\n';
+		if (text.size() > out.size() - 256) {
+			os.write(text.data(), text.size());
+			text.clear();
+		}
+		pc = next;
+	}
+	os.write(text.data(), text.size());
+
+	if (count != UINT64_MAX && (n != count || at != end || nbits)) {
+		std::cout << "Flow trace does not match the image at pc " << to_hex0x32(pc) << std::endl;
+		return false;
+	}
+	return true;
+}
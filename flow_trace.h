@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdio>
+#include <cstdint>
+#include "rv32i_decode.h"
+
+class memory;
+
+// A control-flow trace that holds only what the image cannot tell: one
+// bit per conditional branch, taken or not, and the target of each jalr.
+// replay() rebuilds the pc stream by walking the image from the start pc,
+// so the image must be the one that ran, and code that writes itself is
+// replayed as it was loaded.
+//
+// After magic and the start pc the file is a stream of packets, each
+// opening with a byte:
+//	1..64		that many branch outcomes follow, lowest bit first, in whole bytes
+//	0x80 + k	a jalr target whose k (0..4) low bytes differ from the last
+//			target, which follow, lowest first
+//	0xff		end: the number of instructions executed follows, in 8 bytes
+// Branch outcomes are flushed before each jalr target, so packets come in
+// the order the replay needs them.
+class flow_trace : public rv32i_decode
+{
+public:
+	// Check is_open() before use
+	flow_trace(const std::string& fname, uint32_t start_pc);
+	~flow_trace();
+	flow_trace(const flow_trace&) = delete;
+	flow_trace& operator=(const flow_trace&) = delete;
+
+	bool is_open() const { return f != nullptr; }
+
+	void branch(bool taken)
+	{
+		bits |= uint64_t(taken) << nbits;
+		if (++nbits == 64) put_bits();
+	}
+	void jump(uint32_t target)
+	{
+		if (nbits) put_bits();
+		put_target(target);
+	}
+	// Ends the trace; nothing may be logged after this
+	void finish(uint64_t insns);
+
+	// Write the address of every instruction the trace covers to os, with
+	// its disassembly from mem. Returns false if fname is not a flow trace.
+	static bool replay(const std::string& fname, const memory& mem, std::ostream& os);
+
+private:
+	static constexpr char magic[8] = { 'R', 'V', '3', '2', 'C', 'F', 'T', '1' };
+	static constexpr uint8_t end_packet = 0xff;
+	static constexpr uint8_t target_packet = 0x80;
+	static constexpr size_t flush_size = 1 << 16;
+
+	void put_bits();
+	void put_target(uint32_t target);
+	void put(const void* p, size_t n);
+	void flush();
+
+	std::FILE* f = { nullptr };
+	std::vector<uint8_t> buf;
+	uint64_t bits = { 0 };
+	unsigned nbits = { 0 };
+	uint32_t last_target = { 0 };
+	bool finished = { false };
+};
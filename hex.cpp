@@ -9,45 +9,94 @@
 //****************************************************************************
 
 #include "hex.h"
-#include<iomanip>
-#include<sstream>
-#include<string>
+#include <array>
+#include <cstring>
+#include <string>
+
+// the two digits of every byte value, in order
+static constexpr std::array<char, 512> make_hex_pairs()
+{
+	std::array<char, 512> t = {};
+	for (int i = 0; i < 256; i++) {
+		t[i * 2] = "0123456789abcdef"[i >> 4];
+		t[i * 2 + 1] = "0123456789abcdef"[i & 0xf];
+	}
+	return t;
+}
+
+static constexpr std::array<char, 512> hex_pairs = make_hex_pairs();
+
+char* hex::put_hex8(char* p, uint8_t i)
+{
+	std::memcpy(p, &hex_pairs[i * 2], 2);
+	return p + 2;
+}
+
+char* hex::put_hex16(char* p, uint16_t i)
+{
+	return put_hex8(put_hex8(p, i >> 8), i);
+}
+
+char* hex::put_hex32(char* p, uint32_t i)
+{
+	return put_hex16(put_hex16(p, i >> 16), i);
+}
+
+// no leading zeros
+char* hex::put_hex0x20(char* p, uint32_t i)
+{
+	char digits[8];
+	put_hex32(digits, i & 0xFFFFF);
+	int first = 3;
+	while (first < 7 && digits[first] == '0') first++;
+	*p++ = '0';
+	*p++ = 'x';
+	std::memcpy(p, digits + first, 8 - first);
+	return p + 8 - first;
+}
+
+char* hex::put_hex0x12(char* p, uint32_t i)
+{
+	char digits[4];
+	put_hex16(digits, i & 0xFFF);
+	*p++ = '0';
+	*p++ = 'x';
+	std::memcpy(p, digits + 1, 3);
+	return p + 3;
+}
 
 std::string hex::to_hex8(uint8_t i)
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint16_t>(i);
-	return os.str();
+	char buf[2];
+	return std::string(buf, put_hex8(buf, i));
+}
+
+std::string hex::to_hex16(uint16_t i)
+{
+	char buf[4];
+	return std::string(buf, put_hex16(buf, i));
 }
 
 std::string hex::to_hex32(uint32_t i)
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(8) << i;
-	return os.str();
+	char buf[8];
+	return std::string(buf, put_hex32(buf, i));
 }
 
 std::string hex::to_hex0x32(uint32_t i)
 {
-	std::ostringstream os;
-	os << "0x" << to_hex32(i);
-	return os.str();
+	char buf[10] = { '0', 'x' };
+	return std::string(buf, put_hex32(buf + 2, i));
 }
 
 std::string hex::to_hex0x20(uint32_t i)
 {
-	std::ostringstream os;
-
-	i &= 0xFFFFF;
-	os << std::hex << "0x" << i;
-	return os.str();
+	char buf[7];
+	return std::string(buf, put_hex0x20(buf, i));
 }
 
 std::string hex::to_hex0x12(uint32_t i)
 {
-	std::ostringstream os;
-
-	i &= 0xFFF;
-	os << std::hex << "0x" << std::setw(3) << std::setfill('0') << i;
-	return os.str();
+	char buf[5];
+	return std::string(buf, put_hex0x12(buf, i));
 }
@@ -8,16 +8,37 @@
 //
 //****************************************************************************
 
+#pragma once
+
 #include <string>
+#include <cstdint>
 
 class hex
 {
 public:
+	// Write i as hex digits at p and return the end. These are table
+	// driven and allocate nothing; the to_hex* functions are built on them.
+	static char* put_hex8(char* p, uint8_t i);
+	static char* put_hex16(char* p, uint16_t i);
+	static char* put_hex32(char* p, uint32_t i);
+
+	// text_buffer writes these as the to_hex* function of the same name
+	struct hex8 { hex8(uint8_t v) : i(v) {} uint8_t i; };
+	struct hex16 { hex16(uint16_t v) : i(v) {} uint16_t i; };
+	struct hex32 { hex32(uint32_t v) : i(v) {} uint32_t i; };
+	struct hex0x32 { hex0x32(uint32_t v) : i(v) {} uint32_t i; };
+	struct hex0x20 { hex0x20(uint32_t v) : i(v) {} uint32_t i; };
+	struct hex0x12 { hex0x12(uint32_t v) : i(v) {} uint32_t i; };
+
 	static std::string to_hex8(uint8_t i);
+	static std::string to_hex16(uint16_t i);
 	static std::string to_hex32(uint32_t i);
 	static std::string to_hex0x32(uint32_t i);
 	static std::string to_hex0x20(uint32_t i);
 	static std::string to_hex0x12(uint32_t i);
 
+	// Write the hex0x20 and hex0x12 forms at p and return the end
+	static char* put_hex0x20(char* p, uint32_t i);
+	static char* put_hex0x12(char* p, uint32_t i);
 };
 
@@ -1,19 +1,190 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
 #include "cpu_single_hart.h"
+#include "cpu_multi_hart.h"
+#include "batch.h"
 
+static void usage()
+{
+	std::cerr << "Usage: rv32i [-q] [-d] [-t trace-file] [-T trace-file] [-f flow-file] [-F flow-file] [-p] [-P profile-file] [-k stack-file] [-K interval] [-I cache] [-D cache] [-e interpreter|threaded|jit] [-l exec-limit] [-m hex-mem-size] [-g] [-n harts] [-b dir|list] [-j jobs] [-s boot-insns] [-w] infile[@hex-addr]..." << std::endl;
+	std::cerr << "    -q don't show the instruction trace" << std::endl;
+	std::cerr << "    -d disassemble the code of the infiles instead of running them" << std::endl;
+	std::cerr << "    -t write a binary trace of every instruction executed to trace-file" << std::endl;
+	std::cerr << "       (trace-file.N for hart N when there are several harts)" << std::endl;
+	std::cerr << "    -T print the binary trace in trace-file as an instruction trace and exit" << std::endl;
+	std::cerr << "    -f write a trace of branch outcomes and jalr targets to flow-file" << std::endl;
+	std::cerr << "       (flow-file.N for hart N when there are several harts)" << std::endl;
+	std::cerr << "    -F print every instruction in flow-file, replayed over the infiles, and exit" << std::endl;
+	std::cerr << "    -p count executions per instruction kind and per pc, and report the hottest" << std::endl;
+	std::cerr << "    -P with -p, also write the disassembly annotated with counts to profile-file" << std::endl;
+	std::cerr << "       (profile-file.N for hart N when there are several harts)" << std::endl;
+	std::cerr << "    -k sample a shadow call stack and write folded stacks for flamegraphs to stack-file" << std::endl;
+	std::cerr << "       (stack-file.N for hart N when there are several harts)" << std::endl;
+	std::cerr << "    -K instructions between call stack samples (default: 10000)" << std::endl;
+	std::cerr << "    -I model an L1 instruction cache, given as size[:ways[:line[:lru|fifo|random]]]" << std::endl;
+	std::cerr << "       with size in bytes and an optional k or m suffix (default: 32k:4:64:lru)" << std::endl;
+	std::cerr << "    -D model an L1 data cache, given as for -I" << std::endl;
+	std::cerr << "    -e execution engine (default: interpreter)" << std::endl;
+	std::cerr << "    -l maximum number of instructions to execute (default: no limit)" << std::endl;
+	std::cerr << "    -m memory size in hex, up to 0x100000000 (default: 0x120000)" << std::endl;
+	std::cerr << "    -g reserve the whole address space with guard pages instead of paging memory" << std::endl;
+	std::cerr << "    -n number of harts sharing memory, each on its own thread (default: 1)" << std::endl;
+	std::cerr << "    -b run every image in a directory or .lst file, and any infiles, as a batch" << std::endl;
+	std::cerr << "    -j number of batch jobs to run at once (default: number of host cpus)" << std::endl;
+	std::cerr << "    -s boot the infiles once for this many instructions, then run each batch image" << std::endl;
+	std::cerr << "       in a copy-on-write fork of that state, loaded over it, from where boot stopped" << std::endl;
+	std::cerr << "    -w with -s, run the forks in lock-step groups with vectorised registers" << std::endl;
+	std::cerr << "    infile is an ELF executable or a flat binary, loaded at hex-addr (default: 0)" << std::endl;
+	std::cerr << "    execution starts at the entry point of the first infile" << std::endl;
+	exit(1);
+}
 
 int main(int argc, char ** argv) {
-    
-    if (argc < 2) { std::cout << "Missing file argument" << std::endl; return -1; }
 
-    memory mem = memory(0x120000);
-    cpu_single_hart cpu = cpu_single_hart(mem);
-    mem.load_file(argv[1]);
+	uint64_t memory_limit = 0x120000;
+	uint64_t exec_limit = 0;
+	bool show_instructions = true;
+	bool disassemble = false;
+	std::string trace_file;
+	std::string render_file;
+	std::string flow_file;
+	std::string replay_file;
+	bool profiling = false;
+	std::string annotate_file;
+	std::string stack_file;
+	uint64_t stack_interval = 10000;
+	cache_model::config l1i, l1d;
+	bool model_l1i = false, model_l1d = false;
+	memory::backing backing = memory::backing::paged;
+	rv32i_hart::engine engine = rv32i_hart::engine::interpreter;
+	std::vector<std::string> batch_paths;
+	unsigned jobs = std::thread::hardware_concurrency();
+	unsigned harts = 1;
+	uint64_t boot_limit = 0;
+	bool lockstep = false;
 
-    std::string dump_here = "";
-    cpu.set_show_instructions(true);
-    cpu.run(0);
+	int opt;
+	while ((opt = getopt(argc, argv, "qdgwpt:T:f:F:P:k:K:I:D:e:l:m:n:b:j:s:")) != -1) {
+		switch (opt) {
+		case 'q': show_instructions = false; break;
+		case 'd': disassemble = true; break;
+		case 'g': backing = memory::backing::reserved; break;
+		case 'l': exec_limit = std::stoull(optarg); break;
+		case 'm': memory_limit = std::stoull(optarg, nullptr, 16); break;
+		case 'n': harts = std::max(1ul, std::stoul(optarg)); break;
+		case 'b': batch_paths.push_back(optarg); break;
+		case 'j': jobs = std::stoul(optarg); break;
+		case 's': boot_limit = std::stoull(optarg); break;
+		case 'w': lockstep = true; break;
+		case 't': trace_file = optarg; break;
+		case 'T': render_file = optarg; break;
+		case 'f': flow_file = optarg; break;
+		case 'F': replay_file = optarg; break;
+		case 'p': profiling = true; break;
+		case 'P': annotate_file = optarg; break;
+		case 'k': stack_file = optarg; break;
+		case 'K': stack_interval = std::max(1ull, std::stoull(optarg)); break;
+		case 'I': if (!cache_model::parse(optarg, l1i)) usage(); model_l1i = true; break;
+		case 'D': if (!cache_model::parse(optarg, l1d)) usage(); model_l1d = true; break;
+		case 'e':
+			if (std::string(optarg) == "interpreter") engine = rv32i_hart::engine::interpreter;
+			else if (std::string(optarg) == "threaded") engine = rv32i_hart::engine::threaded;
+			else if (std::string(optarg) == "jit") engine = rv32i_hart::engine::jit;
+			else usage();
+			break;
+		default: usage();
+		}
+	}
 
-    return 0;
-}
\ No newline at end of file
+	if (!render_file.empty()) return trace_log::render(render_file, std::cout) ? 0 : -1;
+
+	if (boot_limit && (batch_paths.empty() || optind >= argc)) usage();
+	if (lockstep && !boot_limit) usage();
+	if ((!trace_file.empty() || !flow_file.empty() || profiling || !stack_file.empty() || model_l1i || model_l1d)
+	    && !batch_paths.empty())
+		usage();
+	if (!annotate_file.empty() && !profiling) usage();
+
+	if (!batch_paths.empty() && !boot_limit) {
+		batch b(memory_limit, backing, engine, exec_limit);
+		for (int i = optind; i < argc; i++) batch_paths.push_back(argv[i]);
+		for (const std::string& path : batch_paths) {
+			if (!b.add(path)) return -1;
+		}
+		b.run(jobs);
+		b.report(std::cout);
+		return 0;
+	}
+
+	if (optind >= argc) { std::cout << "Missing file argument" << std::endl; return -1; }
+
+	memory mem = memory(memory_limit, backing);
+	uint32_t start_pc = 0;
+	for (int i = optind; i < argc; i++) {
+		uint32_t entry;
+		if (!mem.load_image(argv[i], entry)) return -1;
+		if (i == optind) start_pc = entry;
+	}
+
+	// decode the executable parts of the images up front
+	std::vector<std::shared_ptr<const rv32i_predecode>> code;
+	for (const memory::code_range& r : mem.get_code_ranges())
+		code.push_back(std::make_shared<rv32i_predecode>(mem, r.addr, r.len));
+
+	if (disassemble) {
+		for (const auto& r : code) r->disassemble(std::cout, mem);
+		return 0;
+	}
+
+	if (!replay_file.empty()) return flow_trace::replay(replay_file, mem, std::cout) ? 0 : -1;
+
+	if (boot_limit) {
+		cpu_single_hart cpu(mem);
+		cpu.set_pc(start_pc);
+		cpu.set_engine(engine);
+		cpu.set_predecoded(code);
+		cpu.execute(boot_limit);
+		std::cout << "Boot stopped after " << cpu.get_insn_counter() << " instructions at pc "
+			<< hex::to_hex0x32(cpu.get_pc()) << std::endl;
+
+		batch b(memory_limit, backing, engine, exec_limit);
+		b.fork_from(cpu.take_snapshot());
+		b.set_lockstep(lockstep);
+		for (const std::string& path : batch_paths) {
+			if (!b.add(path)) return -1;
+		}
+		b.run(jobs);
+		b.report(std::cout);
+		return 0;
+	}
+
+	auto run = [&](auto& cpu) {
+		cpu.set_pc(start_pc);
+		cpu.set_show_instructions(show_instructions);
+		cpu.set_engine(engine);
+		cpu.set_predecoded(code);
+		if (!trace_file.empty() && !cpu.set_trace_file(trace_file)) return false;
+		if (!flow_file.empty() && !cpu.set_flow_file(flow_file)) return false;
+		cpu.set_profile(profiling);
+		cpu.set_cache_models(model_l1i ? &l1i : nullptr, model_l1d ? &l1d : nullptr);
+		if (!stack_file.empty() && !cpu.set_stack_file(stack_file, stack_interval)) return false;
+		cpu.run(exec_limit);
+		if (!annotate_file.empty() && !cpu.annotate_profile(annotate_file, code)) return false;
+		return true;
+	};
+
+	if (harts > 1) {
+		cpu_multi_hart cpu(mem, harts);
+		if (!run(cpu)) return -1;
+	}
+	else {
+		cpu_single_hart cpu(mem);
+		if (!run(cpu)) return -1;
+	}
+
+	return 0;
+}
@@ -13,23 +13,161 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
 
-memory::memory(uint32_t siz)
+static constexpr int max_reserved = 1024;
+static std::atomic<memory*> reserved_memories[max_reserved];
+static std::atomic_flag commit_lock = ATOMIC_FLAG_INIT;
+static thread_local sigjmp_buf* fault_env = nullptr;
+static thread_local uint32_t fault_addr = 0;
+
+static const uint8_t* fill_page()
 {
-	siz = (siz + 15) & 0xfffffff0;
-	mem = std::vector<uint8_t>(siz);
-	for (unsigned int i = 0; i < mem.size(); i++) {
-		mem[i] = 0xA5;
-	}
+	static const std::vector<uint8_t> page(memory::page_size, 0xA5);
+	return page.data();
+}
+
+memory::memory(uint64_t siz, backing b)
+{
+	size = std::min((siz + 15) & ~uint64_t(15), max_size);
+	if (b == backing::reserved && reserve()) return;
+	init_pages();
+}
+
+// With the paged backing the page table starts out pointing at the
+// snapshot pages, and alloc_page() copies one the first time it is
+// written. With the reserved backing on_segv() copies each page in the
+// first time it is touched.
+memory::memory(std::shared_ptr<const snapshot> from, backing b) : origin(std::move(from))
+{
+	size = origin->size;
+	if (b == backing::reserved && reserve()) return;
+	init_pages();
+}
+
+void memory::init_pages()
+{
+	uint64_t npages = (size + page_size - 1) >> page_shift;
+	if (origin) read_pages = origin->read_pages;
+	else read_pages.assign(npages, fill_page());
+	write_pages.assign(npages, nullptr);
+	pages.resize(npages);
 }
 
 memory::~memory()
 {
+	for (const auto& m : mappings) munmap(m.first, m.second);
+	if (base) {
+		for (std::atomic<memory*>& slot : reserved_memories) {
+			memory* self = this;
+			if (slot.compare_exchange_strong(self, nullptr)) break;
+		}
+		munmap(base, reserve_size);
+	}
+}
+
+void memory::catch_faults(sigjmp_buf* env)
+{
+	fault_env = env;
+}
+
+uint32_t memory::get_fault_addr()
+{
+	return fault_addr;
+}
+
+// Map the whole guest address space (plus a guard page for accesses that
+// straddle the 4 GiB boundary) with no access rights. Returns false, and
+// leaves the paged backing to be used, if that is not possible here.
+bool memory::reserve()
+{
+#if defined(__linux__) && UINTPTR_MAX > 0xffffffff
+	static std::once_flag installed;
+	std::call_once(installed, [] {
+		struct sigaction sa = {};
+		sa.sa_sigaction = on_segv;
+		sa.sa_flags = SA_SIGINFO;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, nullptr);
+	});
+
+	void* m = mmap(nullptr, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) return false;
+
+	base = static_cast<uint8_t*>(m);
+	committed.assign((size + page_size - 1) >> page_shift, uncommitted);
+	// each page goes into dirty at most once between clears
+	dirty.reserve(committed.size());
+	for (std::atomic<memory*>& slot : reserved_memories) {
+		memory* empty = nullptr;
+		if (slot.compare_exchange_strong(empty, this)) return true;
+	}
+	munmap(m, reserve_size);
+	base = nullptr;
+	committed.clear();
+#endif
+	return false;
+}
+
+void memory::on_segv(int sig, siginfo_t* si, void*)
+{
+	uint8_t* a = static_cast<uint8_t*>(si->si_addr);
+
+	for (std::atomic<memory*>& slot : reserved_memories) {
+		memory* m = slot.load(std::memory_order_acquire);
+		if (!m || a < m->base || a >= m->base + reserve_size) continue;
+
+		uint64_t off = a - m->base;
+		if (off < m->size) {
+			// Fill a fresh page off to the side and move it into place in
+			// one step, so another hart never sees it half initialised.
+			uint64_t page = off >> page_shift;
+			uint8_t* p = m->base + (page << page_shift);
+			while (commit_lock.test_and_set(std::memory_order_acquire));
+			if (m->committed[page] == uncommitted) {
+				void* tmp = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (m->origin) {
+					std::memcpy(tmp, m->origin->read_pages[page], page_size);
+					mprotect(tmp, page_size, PROT_READ);
+				}
+				else {
+					std::memset(tmp, 0xA5, page_size);
+				}
+				mremap(tmp, page_size, page_size, MREMAP_MAYMOVE | MREMAP_FIXED, p);
+				m->committed[page] = clean;
+			}
+			else if (m->origin && m->committed[page] == clean) {
+				mprotect(p, page_size, PROT_READ | PROT_WRITE);
+				m->dirty.push_back(page);
+				m->committed[page] = written;
+			}
+			commit_lock.clear(std::memory_order_release);
+			return;
+		}
+
+		fault_addr = uint32_t(off);
+		if (fault_env) siglongjmp(*fault_env, 1);
+		break;
+	}
+
+	// not a guest access: let it crash as usual when the access is retried
+	signal(sig, SIG_DFL);
 }
 
 bool memory::check_illegal(uint32_t i) const
 {
-	bool illegal = i >= mem.size();
+	bool illegal = i >= size;
 
 	if (illegal) {
 		std::cout << "WARNING: Address out of range: " << hex::to_hex0x32(i) << std::endl;
@@ -38,18 +176,83 @@ bool memory::check_illegal(uint32_t i) const
 	return illegal;
 }
 
-uint32_t memory::get_size() const
+uint64_t memory::get_size() const
+{
+	return size;
+}
+
+uint8_t* memory::write_page(uint32_t addr)
+{
+	uint8_t* page = __atomic_load_n(&write_pages[addr >> page_shift], __ATOMIC_ACQUIRE);
+	return page ? page : alloc_page(addr >> page_shift);
+}
+
+uint8_t* memory::alloc_page(uint32_t page)
 {
-	return mem.size();
+	std::lock_guard<std::mutex> lock(page_lock);
+	if (write_pages[page]) return write_pages[page];
+
+	// copy rather than fill, the page may be a mapped file page
+	if (spare.empty()) {
+		pages[page].reset(new uint8_t[page_size]);
+	}
+	else {
+		pages[page] = std::move(spare.back());
+		spare.pop_back();
+	}
+	if (origin) dirty.push_back(page);
+	std::memcpy(pages[page].get(), read_pages[page], page_size);
+	__atomic_store_n(&read_pages[page], pages[page].get(), __ATOMIC_RELEASE);
+	__atomic_store_n(&write_pages[page], pages[page].get(), __ATOMIC_RELEASE);
+	return pages[page].get();
 }
 
 uint8_t memory::get8(uint32_t addr) const
 {
+	if (base) return base[addr];
 	if (check_illegal(addr)) return 0x0;
-	return mem[addr];
+	return read_page(addr)[addr & (page_size - 1)];
+}
+
+// Aligned halfword and word accesses that lie inside memory are done as a
+// single host access. The guest is little-endian, so that only works on a
+// little-endian host; anything else takes the byte-by-byte slow path.
+bool memory::is_fast(uint32_t addr, uint32_t len) const
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return (addr & (len - 1)) == 0 && addr < size;
+#else
+	return false;
+#endif
 }
 
 uint16_t memory::get16(uint32_t addr) const
+{
+	uint16_t data;
+	if (base) {
+		std::memcpy(&data, base + addr, sizeof(data));
+		return data;
+	}
+	if (!is_fast(addr, 2)) return get16_slow(addr);
+
+	std::memcpy(&data, read_page(addr) + (addr & (page_size - 1)), sizeof(data));
+	return data;
+}
+
+uint32_t memory::get32(uint32_t addr) const
+{
+	uint32_t data;
+	if (base) {
+		std::memcpy(&data, base + addr, sizeof(data));
+		return data;
+	}
+	if (!is_fast(addr, 4)) return get32_slow(addr);
+
+	std::memcpy(&data, read_page(addr) + (addr & (page_size - 1)), sizeof(data));
+	return data;
+}
+
+uint16_t memory::get16_slow(uint32_t addr) const
 {
 	uint16_t data_r = get8(addr);
 	uint16_t data_l = get8(addr + 1) << 8;
@@ -57,10 +260,10 @@ uint16_t memory::get16(uint32_t addr) const
 	return data_l | data_r;
 }
 
-uint32_t memory::get32(uint32_t addr) const
+uint32_t memory::get32_slow(uint32_t addr) const
 {
-	uint32_t data_r = get16(addr);
-	uint32_t data_l = get16(addr + 2) << 16;
+	uint32_t data_r = get16_slow(addr);
+	uint32_t data_l = get16_slow(addr + 2) << 16;
 	return data_l | data_r;
 }
 
@@ -87,24 +290,58 @@ int32_t memory::get32_sx(uint32_t addr) const
 
 void memory::set8(uint32_t addr, uint8_t val)
 {
-	if (!check_illegal(addr)) mem[addr] = val;
+	if (base) {
+		base[addr] = val;
+		return;
+	}
+	if (!check_illegal(addr)) write_page(addr)[addr & (page_size - 1)] = val;
 }
 
 void memory::set16(uint32_t addr, uint16_t val)
+{
+	if (base) {
+		std::memcpy(base + addr, &val, sizeof(val));
+		return;
+	}
+	if (!is_fast(addr, 2)) return set16_slow(addr, val);
+
+	std::memcpy(write_page(addr) + (addr & (page_size - 1)), &val, sizeof(val));
+}
+
+void memory::set32(uint32_t addr, uint32_t val)
+{
+	if (base) {
+		std::memcpy(base + addr, &val, sizeof(val));
+		return;
+	}
+	if (!is_fast(addr, 4)) return set32_slow(addr, val);
+
+	std::memcpy(write_page(addr) + (addr & (page_size - 1)), &val, sizeof(val));
+}
+
+uint32_t* memory::atomic_word(uint32_t addr)
+{
+	if (addr & 3) return nullptr;
+	if (base) return reinterpret_cast<uint32_t*>(base + addr);
+	if (check_illegal(addr)) return nullptr;
+	return reinterpret_cast<uint32_t*>(write_page(addr) + (addr & (page_size - 1)));
+}
+
+void memory::set16_slow(uint32_t addr, uint16_t val)
 {
 	set8(addr + 1, val >> 8);
 	set8(addr, val);
 }
 
-void memory::set32(uint32_t addr, uint32_t val)
+void memory::set32_slow(uint32_t addr, uint32_t val)
 {
-	set16(addr + 2, val >> 16);
-	set16(addr, val);
+	set16_slow(addr + 2, val >> 16);
+	set16_slow(addr, val);
 }
 
 void memory::dump() const
 {
-	for (unsigned int i = 0; i < mem.size() / 16; i++) {
+	for (uint64_t i = 0; i < size / 16; i++) {
 		std::cout << hex::to_hex32(i * 16) << ": ";
 		for (int j = 0; j < 16; j++) {
 			std::cout << hex::to_hex8(get8(i * 16 + j)) << " ";
@@ -122,27 +359,291 @@ void memory::dump() const
 	}
 }
 
-bool memory::load_file(const std::string &fname)
+// Pages still shared with the snapshot this memory was made from are
+// shared again rather than copied, so snapshots of forks are cheap.
+std::shared_ptr<const memory::snapshot> memory::take_snapshot() const
+{
+	auto s = std::make_shared<snapshot>();
+	uint64_t npages = (size + page_size - 1) >> page_shift;
+	s->size = size;
+	s->read_pages.assign(npages, fill_page());
+	s->parent = origin;
+
+	for (uint64_t n = 0; n < npages; n++) {
+		const uint8_t* src;
+		if (!base) src = read_pages[n];
+		else if (committed[n]) src = base + (n << page_shift);
+		else src = origin ? origin->read_pages[n] : fill_page();
+
+		if (src == fill_page() || (origin && src == origin->read_pages[n])) {
+			s->read_pages[n] = src;
+			continue;
+		}
+		s->data.emplace_back(new uint8_t[page_size]);
+		std::memcpy(s->data.back().get(), src, page_size);
+		s->read_pages[n] = s->data.back().get();
+	}
+	return s;
+}
+
+void memory::set_baseline()
+{
+	std::shared_ptr<const snapshot> s = take_snapshot();
+	origin = s;
+	dirty.clear();
+	baseline_code_ranges = code_ranges;
+	baseline_symbols = symbols;
+
+	if (base) {
+		for (uint64_t n = 0; n < committed.size(); n++) {
+			if (committed[n] == uncommitted) continue;
+			mprotect(base + (n << page_shift), page_size, PROT_READ);
+			committed[n] = clean;
+		}
+		return;
+	}
+
+	for (auto& p : pages) {
+		if (p) spare.push_back(std::move(p));
+	}
+	read_pages = origin->read_pages;
+	write_pages.assign(write_pages.size(), nullptr);
+}
+
+void memory::reset_to_baseline()
+{
+	for (uint32_t n : dirty) {
+		if (base) {
+			uint8_t* p = base + (uint64_t(n) << page_shift);
+			std::memcpy(p, origin->read_pages[n], page_size);
+			mprotect(p, page_size, PROT_READ);
+			committed[n] = clean;
+		}
+		else {
+			read_pages[n] = origin->read_pages[n];
+			write_pages[n] = nullptr;
+			spare.push_back(std::move(pages[n]));
+		}
+	}
+	dirty.clear();
+	code_ranges = baseline_code_ranges;
+	symbols = baseline_symbols;
+}
+
+bool memory::load_image(const std::string& spec, uint32_t& entry)
 {
-	std::ifstream infile(fname, std::ios::in | std::ios::binary);
-	if (!infile.is_open()) {
+	std::string fname = spec;
+	uint32_t load_addr = 0;
+	size_t at = fname.rfind('@');
+	if (at != std::string::npos) {
+		const char* digits = spec.c_str() + at + 1;
+		char* end;
+		errno = 0;
+		unsigned long long addr = std::strtoull(digits, &end, 16);
+		// hex digits only, with no sign or space, and no more than fit in 32 bits
+		if (!std::isxdigit(uint8_t(*digits)) || *end != '\0' || errno == ERANGE || addr > 0xffffffff) {
+			std::cout << "Bad load address in '" << spec << "'" << std::endl;
+			return false;
+		}
+		load_addr = addr;
+		fname.erase(at);
+	}
+	return load_file(fname, entry, load_addr);
+}
+
+bool memory::load_file(const std::string &fname, uint32_t& entry, uint32_t load_addr)
+{
+	int fd = open(fname.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
 		std::cout << "Can't open file '" << fname << "' for reading" << std::endl;
+		if (fd >= 0) close(fd);
+		return false;
+	}
+
+	uint64_t len = st.st_size;
+	if (len == 0) {
+		close(fd);
+		entry = load_addr;
+		return true;
+	}
+
+	void* image = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED) {
+		std::cout << "Can't map file '" << fname << "'" << std::endl;
+		close(fd);
+		return false;
+	}
+
+	const uint8_t* p = static_cast<const uint8_t*>(image);
+	bool ok;
+	if (len >= SELFMAG && std::memcmp(p, ELFMAG, SELFMAG) == 0) {
+		ok = load_elf(fname, fd, p, len, entry);
+	}
+	else if (load_addr + len > size) {
+		std::cout << "Program too big" << std::endl;
+		ok = false;
+	}
+	else {
+		if (len < zero_copy_min || !map_in(load_addr, fd, p, 0, len)) copy_in(load_addr, p, len);
+		code_ranges.push_back({ load_addr, len });
+		entry = load_addr;
+		ok = true;
+	}
+	close(fd);
+
+	// map_in() leaves image in mappings when guest pages point into it
+	if (!mappings.empty() && mappings.back().first == image) mappings.back().second = len;
+	else munmap(image, len);
+	return ok;
+}
+
+// image is the whole file mapped read-only.
+bool memory::load_elf(const std::string& fname, int fd, const uint8_t* image, uint64_t len, uint32_t& entry)
+{
+	Elf32_Ehdr eh;
+	if (len < sizeof(eh)) {
+		std::cout << "'" << fname << "' is truncated" << std::endl;
+		return false;
+	}
+	std::memcpy(&eh, image, sizeof(eh));
+
+	if (eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_RISCV
+	    || (eh.e_type != ET_EXEC && eh.e_type != ET_DYN)) {
+		std::cout << "'" << fname << "' is not a little-endian ELF32 RISC-V executable" << std::endl;
+		return false;
+	}
+	if (eh.e_phentsize != sizeof(Elf32_Phdr) || eh.e_phoff + uint64_t(eh.e_phnum) * sizeof(Elf32_Phdr) > len) {
+		std::cout << "'" << fname << "' has a bad program header table" << std::endl;
 		return false;
 	}
 
-	uint8_t i;
-	infile >> std::noskipws;
-	for (uint32_t addr = 0; infile >> i; ++addr)
-	{
-		if (check_illegal(addr)) {
+	for (int i = 0; i < eh.e_phnum; i++) {
+		Elf32_Phdr ph;
+		std::memcpy(&ph, image + eh.e_phoff + i * sizeof(ph), sizeof(ph));
+		if (ph.p_type != PT_LOAD || ph.p_memsz == 0) continue;
+
+		if (ph.p_filesz > ph.p_memsz || uint64_t(ph.p_offset) + ph.p_filesz > len) {
+			std::cout << "'" << fname << "' has a bad segment at " << hex::to_hex0x32(ph.p_vaddr) << std::endl;
+			return false;
+		}
+		if (uint64_t(ph.p_vaddr) + ph.p_memsz > size) {
 			std::cout << "Program too big" << std::endl;
-			infile.close();
 			return false;
 		}
 
-		mem[addr] = i;
+		if (ph.p_flags & PF_W || ph.p_filesz < zero_copy_min || !map_in(ph.p_vaddr, fd, image, ph.p_offset, ph.p_filesz))
+			copy_in(ph.p_vaddr, image + ph.p_offset, ph.p_filesz);
+		fill(ph.p_vaddr + ph.p_filesz, 0, ph.p_memsz - ph.p_filesz);
+		if (ph.p_flags & PF_X && ph.p_filesz) code_ranges.push_back({ ph.p_vaddr, ph.p_filesz });
 	}
+
+	load_symbols(image, len);
+	entry = eh.e_entry;
 	return true;
-	
 }
 
+// From .symtab, if there is one. Symbols are only for reports, so a bad
+// section header table just means there are none.
+void memory::load_symbols(const uint8_t* image, uint64_t len)
+{
+	Elf32_Ehdr eh;
+	std::memcpy(&eh, image, sizeof(eh));
+	if (eh.e_shentsize != sizeof(Elf32_Shdr) || eh.e_shoff + uint64_t(eh.e_shnum) * sizeof(Elf32_Shdr) > len) return;
+
+	auto section = [&](uint32_t i) {
+		Elf32_Shdr sh;
+		std::memcpy(&sh, image + eh.e_shoff + i * sizeof(sh), sizeof(sh));
+		return sh;
+	};
+	for (uint32_t i = 0; i < eh.e_shnum; i++) {
+		Elf32_Shdr symtab = section(i);
+		if (symtab.sh_type != SHT_SYMTAB || symtab.sh_link >= eh.e_shnum) continue;
+		Elf32_Shdr strtab = section(symtab.sh_link);
+		if (uint64_t(symtab.sh_offset) + symtab.sh_size > len || uint64_t(strtab.sh_offset) + strtab.sh_size > len) return;
+
+		for (uint32_t off = 0; off + sizeof(Elf32_Sym) <= symtab.sh_size; off += sizeof(Elf32_Sym)) {
+			Elf32_Sym sym;
+			std::memcpy(&sym, image + symtab.sh_offset + off, sizeof(sym));
+			uint32_t type = ELF32_ST_TYPE(sym.st_info);
+			if ((type != STT_FUNC && type != STT_NOTYPE) || sym.st_shndx == SHN_UNDEF || sym.st_shndx >= eh.e_shnum
+			    || !(section(sym.st_shndx).sh_flags & SHF_EXECINSTR) || sym.st_name >= strtab.sh_size)
+				continue;
+			const char* name = reinterpret_cast<const char*>(image + strtab.sh_offset + sym.st_name);
+			std::string n(name, strnlen(name, strtab.sh_size - sym.st_name));
+			// assembler-local and mapping symbols
+			if (n.empty() || n[0] == '$' || n.compare(0, 2, ".L") == 0) continue;
+			symbols.push_back({ sym.st_value, sym.st_size, n });
+		}
+	}
+	std::stable_sort(symbols.begin(), symbols.end(), [](const symbol& a, const symbol& b) { return a.addr < b.addr; });
+}
+
+void memory::copy_in(uint32_t addr, const uint8_t* src, uint64_t len)
+{
+	while (len) {
+		uint32_t off = addr & (page_size - 1);
+		uint32_t n = std::min<uint64_t>(len, page_size - off);
+		std::memcpy(base ? base + addr : write_page(addr) + off, src, n);
+		addr += n;
+		src += n;
+		len -= n;
+	}
+}
+
+void memory::copy_out(uint32_t addr, uint8_t* dst, uint64_t len) const
+{
+	while (len) {
+		uint32_t off = addr & (page_size - 1);
+		uint32_t n = std::min<uint64_t>(len, page_size - off);
+		std::memcpy(dst, base ? base + addr : read_page(addr) + off, n);
+		addr += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+void memory::fill(uint32_t addr, uint8_t val, uint64_t len)
+{
+	while (len) {
+		uint32_t off = addr & (page_size - 1);
+		uint32_t n = std::min<uint64_t>(len, page_size - off);
+		std::memset(base ? base + addr : write_page(addr) + off, val, n);
+		addr += n;
+		len -= n;
+	}
+}
+
+// Back the whole pages of [addr, addr + len) by the file at offset,
+// copy-on-write, and copy the partial pages at either end. Only possible
+// when addr and offset agree within a page, and not once there is an
+// origin, as mapped pages would escape dirty tracking. With the paged
+// backing the page table points into image, which is then kept in
+// mappings.
+bool memory::map_in(uint32_t addr, int fd, const uint8_t* image, uint64_t offset, uint64_t len)
+{
+	if (origin || (addr & (page_size - 1)) != (offset & (page_size - 1)) || sysconf(_SC_PAGESIZE) != page_size) return false;
+
+	uint64_t start = (uint64_t(addr) + page_size - 1) & ~uint64_t(page_size - 1);
+	uint64_t end = (uint64_t(addr) + len) & ~uint64_t(page_size - 1);
+	if (start >= end) return false;
+
+	uint64_t file_start = offset + (start - addr);
+	if (base) {
+		void* m = mmap(base + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_start);
+		if (m == MAP_FAILED) return false;
+		std::fill(committed.begin() + (start >> page_shift), committed.begin() + (end >> page_shift), clean);
+	}
+	else {
+		for (uint64_t a = start; a < end; a += page_size) {
+			pages[a >> page_shift].reset();
+			write_pages[a >> page_shift] = nullptr;
+			read_pages[a >> page_shift] = image + file_start + (a - start);
+		}
+		if (mappings.empty() || mappings.back().first != image) mappings.push_back({ const_cast<uint8_t*>(image), 0 });
+	}
+
+	copy_in(addr, image + offset, start - addr);
+	copy_in(end, image + file_start + (end - start), addr + len - end);
+	return true;
+}
@@ -1,3 +1,4 @@
+
 //****************************************************************************
 //
 // CSCI 463 Assignment 3
@@ -11,15 +12,68 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <memory>
+#include <cstdint>
+#include <csetjmp>
+#include <csignal>
+#include <mutex>
 
+// Guest memory is a table of 4 KiB pages that are only allocated when
+// they are first written. Pages that were never written read as the 0xA5
+// fill pattern, so the cost of a memory depends on the pages touched and
+// not on its size, which may be anything up to the full 4 GiB.
+//
+// The reserved backing instead maps the whole 32-bit guest address space
+// as PROT_NONE host memory. Any uint32_t address is then a valid offset
+// from the base, so accesses need no bounds check. A SIGSEGV handler
+// commits pages below the memory size the first time they are touched.
+// An access at or above the size is a guest fault: the handler
+// siglongjmp()s to the buffer given to catch_faults() on that thread.
+// Only a guest load, store or atomic may fault; callers that cannot be
+// unwound, such as instruction fetch, check the range first.
 class memory
 {
 public:
-	memory(uint32_t s);
+	enum class backing { paged, reserved };
+
+	static constexpr uint32_t page_shift = 12;
+	static constexpr uint32_t page_size = 1 << page_shift;
+	static constexpr uint64_t max_size = uint64_t(1) << 32;
+
+	// The contents of a memory frozen at one point. It never changes, so
+	// any number of memories on any threads can be made from it; each
+	// shares its pages and copies a page only when it first writes it.
+	class snapshot
+	{
+	public:
+		uint64_t get_size() const { return size; }
+
+	private:
+		friend class memory;
+
+		uint64_t size;
+		// read_pages[n] is the fill page, a page in data, or a page of
+		// the snapshot parent was taken from
+		std::vector<const uint8_t*> read_pages;
+		std::vector<std::unique_ptr<uint8_t[]>> data;
+		std::shared_ptr<const snapshot> parent;
+	};
+
+	memory(uint64_t s, backing b = backing::paged);
+	memory(std::shared_ptr<const snapshot> from, backing b = backing::paged);
+	memory(const memory&) = delete;
+	memory& operator=(const memory&) = delete;
 	~memory();
 
+	// The host address of guest address 0 with the reserved backing,
+	// otherwise nullptr.
+	uint8_t* host_base() const { return base; }
+	// the guest address of the last fault caught on this thread
+	static uint32_t get_fault_addr();
+	static void catch_faults(sigjmp_buf* env);
+
 	bool check_illegal(uint32_t addr) const;
-	uint32_t get_size() const;
+	uint64_t get_size() const;
 	uint8_t get8(uint32_t addr) const;
 	uint16_t get16(uint32_t addr) const;
 	uint32_t get32(uint32_t addr) const;
@@ -32,11 +86,111 @@ public:
 	void set16(uint32_t addr, uint16_t val);
 	void set32(uint32_t addr, uint32_t val);
 
+	// Host address of the aligned word at addr for use with host atomics,
+	// or nullptr if addr is misaligned or out of range.
+	uint32_t* atomic_word(uint32_t addr);
+
 	void dump() const;
 
-	bool load_file(const std::string &fname);
+	// Only call this while no hart is running on this memory.
+	std::shared_ptr<const snapshot> take_snapshot() const;
+
+	// Fast reset for running many inputs from one state. set_baseline()
+	// makes the current contents the baseline (a memory made from a
+	// snapshot starts with that snapshot as its baseline), after which
+	// every page written is recorded, and reset_to_baseline() puts back
+	// just those pages, and the code ranges and symbols of the images
+	// loaded by then. Neither may run while a hart is running.
+	void set_baseline();
+	void reset_to_baseline();
+	const std::vector<uint32_t>& get_dirty_pages() const { return dirty; }
+
+	// Load a flat binary at load_addr, or the PT_LOAD segments of an
+	// ELF32 RISC-V executable. entry is set to where execution starts.
+	// Several images may be loaded into one memory.
+	bool load_file(const std::string &fname, uint32_t& entry, uint32_t load_addr = 0);
+	// As load_file() for an image given as fname[@hex-addr]
+	bool load_image(const std::string& spec, uint32_t& entry);
+
+	// The executable segments of the ELF files loaded, and the whole of
+	// each flat binary
+	struct code_range
+	{
+		uint32_t addr;
+		uint64_t len;
+	};
+	const std::vector<code_range>& get_code_ranges() const { return code_ranges; }
+
+	// Function and label symbols in the executable sections of the ELF
+	// files loaded, by address
+	struct symbol
+	{
+		uint32_t addr;
+		uint32_t size;
+		std::string name;
+	};
+	const std::vector<symbol>& get_symbols() const { return symbols; }
+
+	// Copy len bytes at addr out to dst
+	void copy_out(uint32_t addr, uint8_t* dst, uint64_t len) const;
 
 private:
-	std::vector <uint8_t> mem;
- };
+	bool is_fast(uint32_t addr, uint32_t len) const;
+	uint16_t get16_slow(uint32_t addr) const;
+	uint32_t get32_slow(uint32_t addr) const;
+	void set16_slow(uint32_t addr, uint16_t val);
+	void set32_slow(uint32_t addr, uint32_t val);
+
+	const uint8_t* read_page(uint32_t addr) const { return __atomic_load_n(&read_pages[addr >> page_shift], __ATOMIC_ACQUIRE); }
+	uint8_t* write_page(uint32_t addr);
+	uint8_t* alloc_page(uint32_t page);
+
+	static constexpr uint64_t zero_copy_min = 64 << 10;
+
+	bool load_elf(const std::string& fname, int fd, const uint8_t* image, uint64_t len, uint32_t& entry);
+	void load_symbols(const uint8_t* image, uint64_t len);
+	void copy_in(uint32_t addr, const uint8_t* src, uint64_t len);
+	void fill(uint32_t addr, uint8_t val, uint64_t len);
+	bool map_in(uint32_t addr, int fd, const uint8_t* image, uint64_t offset, uint64_t len);
+
+	static constexpr uint64_t reserve_size = max_size + page_size;
+
+	void init_pages();
+	bool reserve();
+	static void on_segv(int sig, siginfo_t* si, void*);
 
+	uint64_t size;
+
+	// the snapshot this memory was made from, whose pages it may share,
+	// or the baseline, and the pages written since
+	std::shared_ptr<const snapshot> origin;
+	std::vector<uint32_t> dirty;
+
+	// reserved backing only: pages already committed by on_segv(). With an
+	// origin, pages are committed read-only and made writable, and added
+	// to dirty, on the first write fault; dirty has room for every page
+	// so that the handler never allocates.
+	enum : uint8_t { uncommitted, clean, written };
+	uint8_t* base = { nullptr };
+	std::vector<uint8_t> committed;
+
+	// read_pages[n] points at page n, or at the shared fill page if page n
+	// has never been written. write_pages[n] is set, and pages[n] owns
+	// page n, once it is allocated. Harts on other threads read both
+	// tables without locking; alloc_page() publishes a new page under
+	// page_lock after it has been filled.
+	std::vector<const uint8_t*> read_pages;
+	std::vector<uint8_t*> write_pages;
+	std::vector<std::unique_ptr<uint8_t[]>> pages;
+	std::mutex page_lock;
+	// pages dropped by reset_to_baseline() for alloc_page() to reuse
+	std::vector<std::unique_ptr<uint8_t[]>> spare;
+
+	// file mappings that read_pages may point into
+	std::vector<std::pair<void*, size_t>> mappings;
+
+	std::vector<code_range> code_ranges;
+	std::vector<symbol> symbols;
+	std::vector<code_range> baseline_code_ranges;
+	std::vector<symbol> baseline_symbols;
+ };
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include "profile.h"
+#include "memory.h"
+
+uint64_t* profile::add_page(uint32_t pc)
+{
+	std::unique_ptr<uint64_t[]>& p = pages[pc >> page_shift];
+	p = std::make_unique<uint64_t[]>(page_size / 2);
+	return p.get();
+}
+
+// count right-aligned in width columns, then its share of total as a
+// percentage
+static void put_count(text_buffer& out, uint64_t count, uint64_t total, size_t width)
+{
+	char b[24];
+	text_buffer n(b, sizeof(b));
+	n << count;
+	out.pad(out.size() + width - std::min(width, n.size()));
+	out.write(n.data(), n.size());
+
+	uint64_t hundredths = total ? count * 10000 / total : 0;
+	out << "  ";
+	if (hundredths < 1000) out << ' ';
+	if (hundredths < 10000) out << ' ';
+	out << hundredths / 100 << '.' << char('0' + hundredths / 10 % 10) << char('0' + hundredths % 10) << '%';
+}
+
+void profile::report(std::ostream& os, const memory& mem, const std::string& hdr) const
+{
+	uint64_t total = 0;
+	for (uint64_t c : op_counts) total += c;
+	if (!total) return;
+
+	char buf[128 + decode_max];
+	text_buffer line(buf, sizeof(buf));
+	auto start = [&]() {
+		line.clear();
+		line.write(hdr.data(), std::min(hdr.size(), size_t(64)));
+		return line.size();
+	};
+	auto end = [&]() {
+		line << '\n';
+		os.write(line.data(), line.size());
+	};
+
+	std::vector<size_t> kinds;
+	for (size_t o = 0; o < size_t(op::count); o++) {
+		if (op_counts[o]) kinds.push_back(o);
+	}
+	std::stable_sort(kinds.begin(), kinds.end(), [this](size_t a, size_t b) { return op_counts[a] > op_counts[b]; });
+	start();
+	line << "Instruction mix:";
+	end();
+	for (size_t o : kinds) {
+		size_t at = start();
+		line << "  " << (o ? op_infos[o].mnemonic : "illegal");
+		line.pad(at + 12);
+		put_count(line, op_counts[o], total, 14);
+		end();
+	}
+
+	std::vector<std::pair<uint64_t, uint32_t>> hot;
+	for (size_t page = 0; page < pages.size(); page++) {
+		if (!pages[page]) continue;
+		for (uint32_t i = 0; i < page_size / 2; i++) {
+			if (pages[page][i]) hot.push_back({ pages[page][i], uint32_t(page << page_shift) + 2 * i });
+		}
+	}
+	size_t n = std::min(hot.size(), hot_insns);
+	std::partial_sort(hot.begin(), hot.begin() + n, hot.end(),
+		[](const auto& a, const auto& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+	start();
+	line << "Hottest instructions:";
+	end();
+	for (size_t i = 0; i < n; i++) {
+		uint32_t pc = hot[i].second;
+		start();
+		line << "  " << hex32(pc);
+		put_count(line, hot[i].first, total, 14);
+		line << "  ";
+		if (uint64_t(pc) + 4 <= mem.get_size()) {
+			uint32_t insn = mem.get16(pc);
+			if (!is_compressed(insn)) insn |= uint32_t(mem.get16(pc + 2)) << 16;
+			decode(line, pc, insn);
+		}
+		end();
+	}
+}
+
+void profile::annotate(std::ostream& os, const memory& mem, uint32_t addr, uint64_t len) const
+{
+	uint64_t total = 0;
+	for (uint64_t c : op_counts) total += c;
+
+	char buf[64 + decode_max];
+	text_buffer line(buf, sizeof(buf));
+	uint64_t end = std::min(uint64_t(addr) + len, mem.get_size());
+	for (uint64_t a = addr; a + 2 <= end; ) {
+		uint32_t pc = a;
+		uint32_t insn = mem.get16(pc);
+		if (!is_compressed(insn) && a + 4 <= end) insn |= uint32_t(mem.get16(pc + 2)) << 16;
+
+		line.clear();
+		if (uint64_t c = get_count(pc)) put_count(line, c, total, 12);
+		line.pad(22);
+		line << "  " << hex32(pc) << ": ";
+		if (is_compressed(insn)) line << "    " << hex16(insn);
+		else line << hex32(insn);
+		line << "  ";
+		decode(line, pc, insn);
+		line << '\n';
+		os.write(line.data(), line.size());
+		a += is_compressed(insn) ? 2 : 4;
+	}
+}
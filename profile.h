@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <cstdint>
+#include "rv32i_decode.h"
+
+class memory;
+
+// Execution counts per instruction kind (one per exec_* handler) and per
+// pc. The pc counts are kept in pages of halfword slots, allocated when
+// code in the page first runs, so a count is two loads and an add.
+class profile : public rv32i_decode
+{
+public:
+	profile() : pages(size_t(1) << (32 - page_shift)) {}
+
+	void count(uint32_t pc, op o)
+	{
+		op_counts[size_t(o)]++;
+		uint64_t* p = pages[pc >> page_shift].get();
+		if (!p) p = add_page(pc);
+		p[(pc & (page_size - 1)) >> 1]++;
+	}
+
+	uint64_t get_count(uint32_t pc) const
+	{
+		const uint64_t* p = pages[pc >> page_shift].get();
+		return p ? p[(pc & (page_size - 1)) >> 1] : 0;
+	}
+
+	// The instruction mix and the hottest instructions, most executed
+	// first, each line starting with hdr. Instructions are disassembled
+	// from mem as it is now.
+	void report(std::ostream& os, const memory& mem, const std::string& hdr = "") const;
+	// Disassemble len bytes from addr in mem, as -d does, with each
+	// instruction's count in front.
+	void annotate(std::ostream& os, const memory& mem, uint32_t addr, uint64_t len) const;
+
+private:
+	static constexpr uint32_t page_shift = 12;
+	static constexpr uint32_t page_size = 1 << page_shift;
+	static constexpr size_t hot_insns = 20;
+
+	uint64_t* add_page(uint32_t pc);
+
+	uint64_t op_counts[size_t(op::count)] = {};
+	std::vector<std::unique_ptr<uint64_t[]>> pages;
+};
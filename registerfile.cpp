@@ -5,39 +5,38 @@
 
 registerfile::registerfile()
 {
-	registers = memory(32 * 4);
-	for (uint32_t i = 0; i < registers.get_size(); i++) registers.set8(i, 0xf0);
-	
-	registers.set32(0, 0);
+	for (uint32_t i = 0; i < 32; i++) registers[i] = 0xf0f0f0f0;
+
+	registers[0] = 0;
 }
 
 void registerfile::reset()
 {
-	for (uint32_t i = 0; i < registers.get_size(); i++) {
-		registers.set8(i, 0);
+	for (uint32_t i = 0; i < 32; i++) {
+		registers[i] = 0;
 	}
 }
 
 void registerfile::set(uint32_t r, int32_t val)
 {
-	if(r > 0) registers.set32(r * 4, val);
+	if(r > 0) registers[r] = val;
 }
 
 int32_t registerfile::get(uint32_t r) const
 {
-	return registers.get32(r * 4);
+	return registers[r];
 }
 
 void registerfile::dump(const std::string& hdr) const
 {
-	for (uint32_t i = 0; i < registers.get_size(); i += 4) {
-		if (i % 32 == 0) {
-			std::string register_name = "x" + std::to_string(i / 4);
+	for (uint32_t i = 0; i < 32; i++) {
+		if (i % 8 == 0) {
+			std::string register_name = "x" + std::to_string(i);
 			std::cout << hdr << std::setw(3) << register_name;
 		}
 
-		std::cout << " " << hex::to_hex32(registers.get32(i));
-		if ((i + 20) % 32 == 0) std::cout << " ";
-		if ((i + 4) % 32 == 0) std::cout << std::endl;
+		std::cout << " " << hex::to_hex32(registers[i]);
+		if (i % 8 == 3) std::cout << " ";
+		if (i % 8 == 7) std::cout << std::endl;
 	}
 }
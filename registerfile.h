@@ -5,7 +5,8 @@
 class registerfile
 {
 private:
-	memory registers = memory(24 * 4);
+	int32_t registers[32];
+	friend class rv32i_jit;
 public:
 	registerfile();
 	void reset();
@@ -13,4 +14,3 @@ public:
 	int32_t get(uint32_t r) const;
 	void dump(const std::string & hdr) const;
 };
-
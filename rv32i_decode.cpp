@@ -1,111 +1,355 @@
 #include "rv32i_decode.h"
-#include<iomanip>
-#include<sstream>
 #include<string>
 
 
-std::string rv32i_decode::decode(uint32_t addr, uint32_t insn)
+// In the order of rv32i_decode::op
+const rv32i_decode::op_info rv32i_decode::op_infos[] = {
+	{ "", format::illegal },
+	{ "lui", format::lui }, { "auipc", format::auipc }, { "jal", format::jal }, { "jalr", format::jalr },
+	{ "beq", format::branch }, { "bne", format::branch }, { "blt", format::branch },
+	{ "bge", format::branch }, { "bltu", format::branch }, { "bgeu", format::branch },
+	{ "lb", format::load }, { "lh", format::load }, { "lw", format::load }, { "lbu", format::load }, { "lhu", format::load },
+	{ "sb", format::store }, { "sh", format::store }, { "sw", format::store },
+	{ "addi", format::alu_imm }, { "slti", format::alu_imm }, { "sltiu", format::alu_imm }, { "xori", format::alu_imm },
+	{ "ori", format::alu_imm }, { "andi", format::alu_imm },
+	{ "slli", format::shift_imm }, { "srli", format::shift_imm }, { "srai", format::shift_imm },
+	{ "add", format::rtype }, { "sub", format::rtype }, { "sll", format::rtype }, { "slt", format::rtype },
+	{ "sltu", format::rtype }, { "xor", format::rtype }, { "srl", format::rtype }, { "sra", format::rtype },
+	{ "or", format::rtype }, { "and", format::rtype },
+	{ "mul", format::rtype }, { "mulh", format::rtype }, { "mulhsu", format::rtype }, { "mulhu", format::rtype },
+	{ "div", format::rtype }, { "divu", format::rtype }, { "rem", format::rtype }, { "remu", format::rtype },
+	{ "ecall", format::bare }, { "ebreak", format::bare },
+	{ "csrrw", format::csr }, { "csrrs", format::csr }, { "csrrc", format::csr },
+	{ "csrrwi", format::csri }, { "csrrsi", format::csri }, { "csrrci", format::csri },
+	{ "fence", format::fence }, { "fence.i", format::bare },
+	{ "lr.w", format::amo }, { "sc.w", format::amo }, { "amoswap.w", format::amo }, { "amoadd.w", format::amo },
+	{ "amoxor.w", format::amo }, { "amoand.w", format::amo }, { "amoor.w", format::amo }, { "amomin.w", format::amo },
+	{ "amomax.w", format::amo }, { "amominu.w", format::amo }, { "amomaxu.w", format::amo },
+};
+
+// Each pattern gives the opcode, the funct3 (or any_funct3) and the
+// funct7 bits under funct7_mask that select an instruction.
+constexpr std::array<rv32i_decode::op, rv32i_decode::op_table_size> rv32i_decode::make_op_table()
 {
-	if (insn == insn_ebreak) return render_ebreak(insn);
-	if (insn == insn_ecall) return render_ecall(insn);
-	switch (get_opcode(insn))
-	{
-	default: return render_illegal_insn(insn);
-	case opcode_lui: return render_lui(insn);
-	case opcode_auipc: return render_auipc(insn);
-	case opcode_jal: return render_jal(addr, insn);
-	case opcode_jalr: return render_jalr(insn);
-
-	case opcode_btype:
-		switch (get_funct3(insn))
-		{
-		default: return render_illegal_insn(insn);
-		case funct3_beq: return render_btype(addr, insn, "beq");
-		case funct3_bne: return render_btype(addr, insn, "bne");
-		case funct3_blt: return render_btype(addr, insn, "blt");
-		case funct3_bge: return render_btype(addr, insn, "bge");
-		case funct3_bltu: return render_btype(addr, insn, "bltu");
-		case funct3_bgeu: return render_btype(addr, insn, "bgeu");
+	struct pattern { uint32_t opcode; uint32_t funct3; uint32_t funct7; uint32_t funct7_mask; op o; };
+	constexpr uint32_t any_funct3 = 8;
+	constexpr uint32_t amo = 0b1111100;
+	constexpr pattern patterns[] = {
+		{ opcode_lui, any_funct3, 0, 0, op::lui },
+		{ opcode_auipc, any_funct3, 0, 0, op::auipc },
+		{ opcode_jal, any_funct3, 0, 0, op::jal },
+		{ opcode_jalr, 0, 0, 0, op::jalr },
+
+		{ opcode_btype, funct3_beq, 0, 0, op::beq },
+		{ opcode_btype, funct3_bne, 0, 0, op::bne },
+		{ opcode_btype, funct3_blt, 0, 0, op::blt },
+		{ opcode_btype, funct3_bge, 0, 0, op::bge },
+		{ opcode_btype, funct3_bltu, 0, 0, op::bltu },
+		{ opcode_btype, funct3_bgeu, 0, 0, op::bgeu },
+
+		{ opcode_load_imm, funct3_lb, 0, 0, op::lb },
+		{ opcode_load_imm, funct3_lh, 0, 0, op::lh },
+		{ opcode_load_imm, funct3_lw, 0, 0, op::lw },
+		{ opcode_load_imm, funct3_lbu, 0, 0, op::lbu },
+		{ opcode_load_imm, funct3_lhu, 0, 0, op::lhu },
+
+		{ opcode_stype, funct3_sb, 0, 0, op::sb },
+		{ opcode_stype, funct3_sh, 0, 0, op::sh },
+		{ opcode_stype, funct3_sw, 0, 0, op::sw },
+
+		{ opcode_alu_imm, funct3_add, 0, 0, op::addi },
+		{ opcode_alu_imm, funct3_slt, 0, 0, op::slti },
+		{ opcode_alu_imm, funct3_sltu, 0, 0, op::sltiu },
+		{ opcode_alu_imm, funct3_xor, 0, 0, op::xori },
+		{ opcode_alu_imm, funct3_or, 0, 0, op::ori },
+		{ opcode_alu_imm, funct3_and, 0, 0, op::andi },
+		{ opcode_alu_imm, funct3_sll, 0, 0x7f, op::slli },
+		{ opcode_alu_imm, funct3_srx, funct7_srl, 0x7f, op::srli },
+		{ opcode_alu_imm, funct3_srx, funct7_sra, 0x7f, op::srai },
+
+		{ opcode_rtype, funct3_add, funct7_add, 0x7f, op::add },
+		{ opcode_rtype, funct3_add, funct7_sub, 0x7f, op::sub },
+		{ opcode_rtype, funct3_sll, 0, 0x7f, op::sll },
+		{ opcode_rtype, funct3_slt, 0, 0x7f, op::slt },
+		{ opcode_rtype, funct3_sltu, 0, 0x7f, op::sltu },
+		{ opcode_rtype, funct3_xor, 0, 0x7f, op::xor_ },
+		{ opcode_rtype, funct3_srx, funct7_srl, 0x7f, op::srl },
+		{ opcode_rtype, funct3_srx, funct7_sra, 0x7f, op::sra },
+		{ opcode_rtype, funct3_or, 0, 0x7f, op::or_ },
+		{ opcode_rtype, funct3_and, 0, 0x7f, op::and_ },
+
+		{ opcode_rtype, funct3_mul, funct7_muldiv, 0x7f, op::mul },
+		{ opcode_rtype, funct3_mulh, funct7_muldiv, 0x7f, op::mulh },
+		{ opcode_rtype, funct3_mulhsu, funct7_muldiv, 0x7f, op::mulhsu },
+		{ opcode_rtype, funct3_mulhu, funct7_muldiv, 0x7f, op::mulhu },
+		{ opcode_rtype, funct3_div, funct7_muldiv, 0x7f, op::div },
+		{ opcode_rtype, funct3_divu, funct7_muldiv, 0x7f, op::divu },
+		{ opcode_rtype, funct3_rem, funct7_muldiv, 0x7f, op::rem },
+		{ opcode_rtype, funct3_remu, funct7_muldiv, 0x7f, op::remu },
+
+		// ecall and ebreak share this slot; get_op() tells them apart
+		{ opcode_system, 0, 0, 0, op::ecall },
+		{ opcode_system, funct3_csrrw, 0, 0, op::csrrw },
+		{ opcode_system, funct3_csrrs, 0, 0, op::csrrs },
+		{ opcode_system, funct3_csrrc, 0, 0, op::csrrc },
+		{ opcode_system, funct3_csrrwi, 0, 0, op::csrrwi },
+		{ opcode_system, funct3_csrrsi, 0, 0, op::csrrsi },
+		{ opcode_system, funct3_csrrci, 0, 0, op::csrrci },
+
+		{ opcode_misc_mem, funct3_fence, 0, 0, op::fence },
+		{ opcode_misc_mem, funct3_fence_i, 0, 0, op::fence_i },
+
+		// funct7 of an AMO is funct5 followed by the aq and rl bits
+		{ opcode_amo, funct3_amo_w, funct5_lr << 2, amo, op::lr_w },
+		{ opcode_amo, funct3_amo_w, funct5_sc << 2, amo, op::sc_w },
+		{ opcode_amo, funct3_amo_w, funct5_amoswap << 2, amo, op::amoswap_w },
+		{ opcode_amo, funct3_amo_w, funct5_amoadd << 2, amo, op::amoadd_w },
+		{ opcode_amo, funct3_amo_w, funct5_amoxor << 2, amo, op::amoxor_w },
+		{ opcode_amo, funct3_amo_w, funct5_amoand << 2, amo, op::amoand_w },
+		{ opcode_amo, funct3_amo_w, funct5_amoor << 2, amo, op::amoor_w },
+		{ opcode_amo, funct3_amo_w, funct5_amomin << 2, amo, op::amomin_w },
+		{ opcode_amo, funct3_amo_w, funct5_amomax << 2, amo, op::amomax_w },
+		{ opcode_amo, funct3_amo_w, funct5_amominu << 2, amo, op::amominu_w },
+		{ opcode_amo, funct3_amo_w, funct5_amomaxu << 2, amo, op::amomaxu_w },
+	};
+
+	std::array<op, op_table_size> table = {};
+	for (const pattern& p : patterns) {
+		for (uint32_t funct3 = 0; funct3 < 8; funct3++) {
+			if (p.funct3 != any_funct3 && p.funct3 != funct3) continue;
+			for (uint32_t funct7 = 0; funct7 < 128; funct7++) {
+				if ((funct7 & p.funct7_mask) == p.funct7)
+					table[(p.opcode >> 2) | funct3 << 5 | funct7 << 8] = p.o;
+			}
 		}
+	}
+	return table;
+}
 
-	case opcode_load_imm:
-		switch (get_funct3(insn))
-		{
-		default: return render_illegal_insn(insn);
-		case funct3_lb: return render_itype_load(insn, "lb");
-		case funct3_lh: return render_itype_load(insn, "lh");
-		case funct3_lw: return render_itype_load(insn, "lw");
-		case funct3_lbu: return render_itype_load(insn, "lbu");
-		case funct3_lhu: return render_itype_load(insn, "lhu");
-		}
+constexpr std::array<rv32i_decode::op, rv32i_decode::op_table_size> rv32i_decode::op_table = make_op_table();
 
-	case opcode_stype:
-		switch (get_funct3(insn))
-		{
-		default: return render_illegal_insn(insn);
-		case funct3_sb: return render_stype(insn, "sb");
-		case funct3_sh: return render_stype(insn, "sh");
-		case funct3_sw: return render_stype(insn, "sw");
-		}
+std::string rv32i_decode::decode(uint32_t addr, uint32_t insn)
+{
+	char buf[decode_max];
+	text_buffer out(buf, sizeof(buf));
+	decode(out, addr, insn);
+	return std::string(out.data(), out.size());
+}
 
-	case opcode_alu_imm:
-		switch (get_funct3(insn))
-		{
-		default: return render_illegal_insn(insn);
-		case funct3_add: return render_itype_alu(insn, "addi", get_imm_i(insn));
-		case funct3_slt: return render_itype_alu(insn, "slti", get_imm_i(insn));
-		case funct3_sltu: return render_itype_alu(insn, "sltiu", get_imm_i(insn));
-		case funct3_xor: return render_itype_alu(insn, "xori", get_imm_i(insn));
-		case funct3_or: return render_itype_alu(insn, "ori", get_imm_i(insn));
-		case funct3_and: return render_itype_alu(insn, "andi", get_imm_i(insn));
-		case funct3_sll: return render_itype_alu(insn, "slli", get_imm_i(insn));
-		case funct3_srx:
-			switch (get_funct7(insn))
-			{
-			default: return render_illegal_insn(insn);
-			case funct7_sra: return render_itype_alu(insn, "srai", get_imm_i(insn) % XLEN);
-			case funct7_srl: return render_itype_alu(insn, "srli", get_imm_i(insn) % XLEN);
-			}
-		
+void rv32i_decode::decode(text_buffer& out, uint32_t addr, uint32_t insn)
+{
+	static_assert(sizeof(op_infos) / sizeof(op_infos[0]) == size_t(op::count), "op_infos must list every op");
+	if (is_compressed(insn)) render_compressed(out, addr, insn);
+	else render(out, addr, insn, get_op(insn));
+}
 
-		}
+int32_t rv32i_decode::get_imm(uint32_t insn, op o)
+{
+	switch (op_infos[size_t(o)].fmt) {
+	default: return 0;
+	case format::lui:
+	case format::auipc: return get_imm_u(insn) << 12;
+	case format::jal: return get_imm_j(insn);
+	case format::branch: return get_imm_b(insn);
+	case format::store: return get_imm_s(insn);
+	case format::shift_imm: return get_imm_i(insn) % XLEN;
+	case format::jalr:
+	case format::load:
+	case format::alu_imm:
+	case format::csr:
+	case format::csri: return get_imm_i(insn);
+	}
+}
 
-	case opcode_rtype:
-		switch (get_funct3(insn))
-		{
-		default: return render_illegal_insn(insn);
-		case funct3_add: return render_rtype(insn, "add");
-		case funct3_and: return render_rtype(insn, "and");
-		case funct3_or: return render_rtype(insn, "or");
-		case funct3_sll: return render_rtype(insn, "sll");
-		case funct3_slt: return render_rtype(insn, "slt");
-		case funct3_sltu: return render_rtype(insn, "sltu");
-		case funct3_xor: return render_rtype(insn, "xor");
-		case funct3_srx:
-			switch (get_funct7(insn))
-			{
-			default: return render_illegal_insn(insn);
-			case funct7_sra: return render_rtype(insn, "sra");
-			case funct7_srl: return render_rtype(insn, "srl");
-			}
+void rv32i_decode::render(text_buffer& out, uint32_t addr, uint32_t insn, op o)
+{
+	const char* m = op_infos[size_t(o)].mnemonic;
+	switch (op_infos[size_t(o)].fmt)
+	{
+	case format::illegal: break;
+	case format::lui: return render_lui(out, insn);
+	case format::auipc: return render_auipc(out, insn);
+	case format::jal: return render_jal(out, addr, insn);
+	case format::jalr: return render_jalr(out, insn);
+	case format::branch: return render_btype(out, addr, insn, m);
+	case format::load: return render_itype_load(out, insn, m);
+	case format::store: return render_stype(out, insn, m);
+	case format::alu_imm: return render_itype_alu(out, insn, m, get_imm_i(insn));
+	case format::shift_imm: return render_itype_alu(out, insn, m, get_imm_i(insn) % XLEN);
+	case format::rtype: return render_rtype(out, insn, m);
+	case format::csr: return render_csrrx(out, insn, m);
+	case format::csri: return render_csrrxi(out, insn, m);
+	case format::bare: return render_mnemonic(out, m);
+	case format::fence: return render_fence(out, insn);
+	case format::amo: return render_amo(out, insn, m);
+	}
+	render_illegal_insn(out, insn);
+}
 
+// Expand an RV32C instruction. The quadrant is in bits 1:0 and the
+// operation in bits 15:13; the 3-bit register fields address x8-x15.
+uint32_t rv32i_decode::expand_compressed(uint16_t c, const char** mnemonic)
+{
+	auto bits = [c](int hi, int lo) { return uint32_t(c >> lo) & ((1u << (hi - lo + 1)) - 1); };
+	auto sext = [](uint32_t v, int width) { return int32_t(v << (32 - width)) >> (32 - width); };
+
+	auto itype = [](uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, int32_t imm) {
+		return uint32_t(imm) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+	};
+	auto stype = [](uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+		return (uint32_t(imm) >> 5 & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1f) << 7 | opcode_stype;
+	};
+	auto btype = [](uint32_t funct3, uint32_t rs1, int32_t imm) {
+		uint32_t u = imm;
+		return (u >> 12 & 1) << 31 | (u >> 5 & 0x3f) << 25 | rs1 << 15 | funct3 << 12 | (u >> 1 & 0xf) << 8
+			| (u >> 11 & 1) << 7 | opcode_btype;
+	};
+	auto jtype = [](uint32_t rd, int32_t imm) {
+		uint32_t u = imm;
+		return (u >> 20 & 1) << 31 | (u >> 1 & 0x3ff) << 21 | (u >> 11 & 1) << 20 | (u >> 12 & 0xff) << 12 | rd << 7 | opcode_jal;
+	};
+	auto rtype = [](uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd) {
+		return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode_rtype;
+	};
+
+	const char* m = nullptr;
+	uint32_t insn = 0;
+
+	uint32_t rd = bits(11, 7);
+	uint32_t rs2 = bits(6, 2);
+	uint32_t rd_c = 8 + bits(4, 2);
+	uint32_t rs1_c = 8 + bits(9, 7);
+	int32_t imm6 = sext(bits(12, 12) << 5 | bits(6, 2), 6);
+	uint32_t shamt = bits(6, 2);
+	int32_t imm_j = sext(bits(12, 12) << 11 | bits(11, 11) << 4 | bits(10, 9) << 8 | bits(8, 8) << 10
+		| bits(7, 7) << 6 | bits(6, 6) << 7 | bits(5, 3) << 1 | bits(2, 2) << 5, 12);
+	int32_t imm_b = sext(bits(12, 12) << 8 | bits(11, 10) << 3 | bits(6, 5) << 6 | bits(4, 3) << 1 | bits(2, 2) << 5, 9);
+	uint32_t uimm_w = bits(12, 10) << 3 | bits(6, 6) << 2 | bits(5, 5) << 6;
+
+	switch (bits(1, 0) << 3 | bits(15, 13)) {
+	case 0b00000:
+		if (uint32_t nzuimm = bits(12, 11) << 4 | bits(10, 7) << 6 | bits(6, 6) << 2 | bits(5, 5) << 3) {
+			m = "c.addi4spn";
+			insn = itype(opcode_alu_imm, rd_c, funct3_add, 2, nzuimm);
 		}
-
-	case opcode_system:
-		switch (get_funct3(insn))
+		break;
+	case 0b00010:
+		m = "c.lw";
+		insn = itype(opcode_load_imm, rd_c, funct3_lw, rs1_c, uimm_w);
+		break;
+	case 0b00110:
+		m = "c.sw";
+		insn = stype(funct3_sw, rs1_c, rd_c, uimm_w);
+		break;
+
+	case 0b01000:
+		m = rd ? "c.addi" : "c.nop";
+		insn = itype(opcode_alu_imm, rd, funct3_add, rd, imm6);
+		break;
+	case 0b01001:
+		m = "c.jal";
+		insn = jtype(1, imm_j);
+		break;
+	case 0b01010:
+		m = "c.li";
+		insn = itype(opcode_alu_imm, rd, funct3_add, 0, imm6);
+		break;
+	case 0b01011:
+		if (rd == 2) {
+			int32_t imm = sext(bits(12, 12) << 9 | bits(6, 6) << 4 | bits(5, 5) << 6 | bits(4, 3) << 7 | bits(2, 2) << 5, 10);
+			if (imm) {
+				m = "c.addi16sp";
+				insn = itype(opcode_alu_imm, 2, funct3_add, 2, imm);
+			}
+		}
+		else if (imm6) {
+			m = "c.lui";
+			insn = (uint32_t(imm6) & 0xfffff) << 12 | rd << 7 | opcode_lui;
+		}
+		break;
+	case 0b01100:
+		switch (bits(11, 10)) {
+		case 0b00:
+			if (bits(12, 12)) break;
+			m = "c.srli";
+			insn = itype(opcode_alu_imm, rs1_c, funct3_srx, rs1_c, shamt);
+			break;
+		case 0b01:
+			if (bits(12, 12)) break;
+			m = "c.srai";
+			insn = itype(opcode_alu_imm, rs1_c, funct3_srx, rs1_c, funct7_sra << 5 | shamt);
+			break;
+		case 0b10:
+			m = "c.andi";
+			insn = itype(opcode_alu_imm, rs1_c, funct3_and, rs1_c, imm6);
+			break;
+		case 0b11:
 		{
-		default: return render_illegal_insn(insn);
-		case funct3_csrrw: return render_csrrx(insn, "csrrw");
-		case funct3_csrrs: return render_csrrx(insn, "csrrs");
-		case funct3_csrrc: return render_csrrx(insn, "csrrc");
-		case funct3_csrrwi: return render_csrrxi(insn, "csrrwi");
-		case funct3_csrrsi: return render_csrrxi(insn, "csrrsi");
-		case funct3_csrrci: return render_csrrxi(insn, "csrrci");
+			if (bits(12, 12)) break;
+			static const char* const names[4] = { "c.sub", "c.xor", "c.or", "c.and" };
+			static constexpr uint32_t funct3[4] = { funct3_add, funct3_xor, funct3_or, funct3_and };
+			m = names[bits(6, 5)];
+			insn = rtype(bits(6, 5) == 0 ? funct7_sub : 0, rd_c, rs1_c, funct3[bits(6, 5)], rs1_c);
+			break;
+		}
+		}
+		break;
+	case 0b01101:
+		m = "c.j";
+		insn = jtype(0, imm_j);
+		break;
+	case 0b01110:
+		m = "c.beqz";
+		insn = btype(funct3_beq, rs1_c, imm_b);
+		break;
+	case 0b01111:
+		m = "c.bnez";
+		insn = btype(funct3_bne, rs1_c, imm_b);
+		break;
+
+	case 0b10000:
+		if (bits(12, 12)) break;
+		m = "c.slli";
+		insn = itype(opcode_alu_imm, rd, funct3_sll, rd, shamt);
+		break;
+	case 0b10010:
+		if (rd) {
+			m = "c.lwsp";
+			insn = itype(opcode_load_imm, rd, funct3_lw, 2, bits(12, 12) << 5 | bits(6, 4) << 2 | bits(3, 2) << 6);
+		}
+		break;
+	case 0b10100:
+		if (!bits(12, 12)) {
+			if (rs2) {
+				m = "c.mv";
+				insn = rtype(0, rs2, 0, funct3_add, rd);
+			}
+			else if (rd) {
+				m = "c.jr";
+				insn = itype(opcode_jalr, 0, 0, rd, 0);
+			}
+		}
+		else if (rs2) {
+			m = "c.add";
+			insn = rtype(0, rs2, rd, funct3_add, rd);
+		}
+		else if (rd) {
+			m = "c.jalr";
+			insn = itype(opcode_jalr, 1, 0, rd, 0);
 		}
+		else {
+			m = "c.ebreak";
+			insn = insn_ebreak;
+		}
+		break;
+	case 0b10110:
+		m = "c.swsp";
+		insn = stype(funct3_sw, 2, rs2, bits(12, 9) << 2 | bits(8, 7) << 6);
+		break;
 	}
 
-	
-	
+	if (mnemonic) *mnemonic = m;
+	return insn;
 }
 
 // get opcode
@@ -126,6 +370,12 @@ uint32_t rv32i_decode::get_funct3(uint32_t insn)
 	return insn << 17 >> 29;
 }
 
+// get funct5, the AMO operation
+uint32_t rv32i_decode::get_funct5(uint32_t insn)
+{
+	return insn >> 27;
+}
+
 // get rs1
 uint32_t rv32i_decode::get_rs1(uint32_t insn)
 {
@@ -191,10 +441,10 @@ int32_t rv32i_decode::get_imm_s(uint32_t insn)
 // get imm j
 int32_t rv32i_decode::get_imm_j(uint32_t insn)
 {
-	uint32_t right = insn >> 21 << 1;
+	uint32_t right = insn >> 21 << 1 & 0x7fe;
 	uint32_t center = insn & 0x000FF000;
 	uint32_t complete = center | right;
-	if (complete & 0x00080000) {
+	if (insn & 0x80000000) {
 		complete |= 0xFFF00000;
 	}
 	
@@ -205,164 +455,191 @@ int32_t rv32i_decode::get_imm_j(uint32_t insn)
 }
 
 // render illegal instruction
-std::string rv32i_decode::render_illegal_insn(uint32_t insn)
+void rv32i_decode::render_illegal_insn(text_buffer& out, uint32_t insn)
 {
-	return "ERROR: UNIMPLEMENTED INSTRUCTION";
+	out << "ERROR: UNIMPLEMENTED INSTRUCTION";
 }
 
 // render lui
-std::string rv32i_decode::render_lui(uint32_t insn)
+void rv32i_decode::render_lui(text_buffer& out, uint32_t insn)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_u(insn);
-	std::ostringstream os;
-	os << render_mnemonic("lui") << render_reg(rd) << ","
-		<< hex::to_hex0x20(imm_u);
-	return os.str();
-
+	render_mnemonic(out, "lui");
+	out << 'x' << get_rd(insn) << ',' << hex0x20(uint32_t(get_imm_u(insn)));
 }
 
 // render auipc
-std::string rv32i_decode::render_auipc(uint32_t insn)
+void rv32i_decode::render_auipc(text_buffer& out, uint32_t insn)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_u(insn);
-	std::ostringstream os;
-	os << render_mnemonic("auipc") << render_reg(rd) << ","
-		<< hex::to_hex0x20(imm_u);
-	return os.str();
+	render_mnemonic(out, "auipc");
+	out << 'x' << get_rd(insn) << ',' << hex0x20(uint32_t(get_imm_u(insn)));
 }
 
 // render jal
-std::string rv32i_decode::render_jal(uint32_t addr, uint32_t insn)
+void rv32i_decode::render_jal(text_buffer& out, uint32_t addr, uint32_t insn)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_j(insn);
-	std::ostringstream os;
-	os << render_mnemonic("jal") << render_reg(rd) << ","
-		<< hex::to_hex0x32(imm_u);
-	return os.str();
+	render_mnemonic(out, "jal");
+	out << 'x' << get_rd(insn) << ',' << hex0x32(uint32_t(get_imm_j(insn)));
 }
 
 // render jalr
-std::string rv32i_decode::render_jalr(uint32_t insn)
+void rv32i_decode::render_jalr(text_buffer& out, uint32_t insn)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
-	std::ostringstream os;
-	os << render_mnemonic("jalr") << render_reg(rd) << ","
-		<< imm_u << "(" << render_reg(rs1) << ")";
-	return os.str();
+	render_mnemonic(out, "jalr");
+	out << 'x' << get_rd(insn) << ',' << get_imm_i(insn) << "(x" << get_rs1(insn) << ')';
 }
 
 // render btype
-std::string rv32i_decode::render_btype(uint32_t addr, uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_btype(text_buffer& out, uint32_t addr, uint32_t insn, const char* mnemonic)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rs1) << ","
-		<< render_reg(rs2) << "," << to_hex0x32(imm_u + addr);
-	return os.str();
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rs1(insn) << ",x" << get_rs2(insn) << ',' << hex0x32(get_imm_b(insn) + addr);
 }
 
 // render itype
-std::string rv32i_decode::render_itype_load(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_itype_load(text_buffer& out, uint32_t insn, const char* mnemonic)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << ","
-		<< imm_u << "(" << render_reg(rs1) << ")";
-	return os.str();
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rd(insn) << ',' << get_imm_i(insn) << "(x" << get_rs1(insn) << ')';
 }
 
 // render stype
-std::string rv32i_decode::render_stype(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_stype(text_buffer& out, uint32_t insn, const char* mnemonic)
 {
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_s(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rs2) << ","
-		<< imm_u << "(" << render_reg(rs1) << ")";
-	return os.str();
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rs2(insn) << ',' << get_imm_s(insn) << "(x" << get_rs1(insn) << ')';
 }
 
 // render itype alu
-std::string rv32i_decode::render_itype_alu(uint32_t insn, const char* mnemonic, int32_t imm_i)
+void rv32i_decode::render_itype_alu(text_buffer& out, uint32_t insn, const char* mnemonic, int32_t imm_i)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << "," << render_reg(rs1) << ","
-		<< imm_i;
-	return os.str();
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rd(insn) << ",x" << get_rs1(insn) << ',' << imm_i;
 }
 
 // render rtype
-std::string rv32i_decode::render_rtype(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_rtype(text_buffer& out, uint32_t insn, const char* mnemonic)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << "," << render_reg(rs1) << ","
-		<< render_reg(rs2);
-	return os.str();
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rd(insn) << ",x" << get_rs1(insn) << ",x" << get_rs2(insn);
 }
 
 // render ecall
-std::string rv32i_decode::render_ecall(uint32_t insn)
+void rv32i_decode::render_ecall(text_buffer& out, uint32_t insn)
 {
-	return "ecall";
+	out << "ecall";
 }
 
 // render ebreak
-std::string rv32i_decode::render_ebreak(uint32_t insn)
+void rv32i_decode::render_ebreak(text_buffer& out, uint32_t insn)
 {
-	return "ebreak";
+	out << "ebreak";
 }
 
 // render csrrx
-std::string rv32i_decode::render_csrrx(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_csrrx(text_buffer& out, uint32_t insn, const char* mnemonic)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t imm = get_imm_i(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << "," << to_hex0x12(imm) << ","
-		<< render_reg(rs1);
-	return os.str();
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rd(insn) << ',' << hex0x12(uint32_t(get_imm_i(insn))) << ",x" << get_rs1(insn);
 }
 
 // render csrrxi
-std::string rv32i_decode::render_csrrxi(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_csrrxi(text_buffer& out, uint32_t insn, const char* mnemonic)
+{
+	render_mnemonic(out, mnemonic);
+	out << 'x' << get_rd(insn) << ',' << hex0x12(uint32_t(get_imm_i(insn))) << ',' << get_rs1(insn);
+}
+
+// render fence with its predecessor and successor sets
+void rv32i_decode::render_fence(text_buffer& out, uint32_t insn)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t imm = get_imm_i(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << "," << to_hex0x12(imm) << ","
-		<< rs1;
-	return os.str();
+	render_mnemonic(out, "fence");
+	for (int i = 3; i >= 0; i--) {
+		if (insn & (1 << (24 + i))) out << "iorw"[3 - i];
+	}
+	out << ',';
+	for (int i = 3; i >= 0; i--) {
+		if (insn & (1 << (20 + i))) out << "iorw"[3 - i];
+	}
 }
 
-// render reg
-std::string rv32i_decode::render_reg(int r)
+// render an AMO as rd,rs2,(rs1), or rd,(rs1) for lr.w, with any
+// .aq/.rl ordering suffix
+void rv32i_decode::render_amo(text_buffer& out, uint32_t insn, const char* mnemonic)
 {
-	std::ostringstream os;
-	os << "x" << r;
-	return os.str();
+	char buf[mnemonic_width * 2];
+	text_buffer m(buf, sizeof(buf) - 1);
+	m << mnemonic;
+	if (insn & (1 << 26)) m << ".aq";
+	if (insn & (1 << 25)) m << ((insn & (1 << 26)) ? "rl" : ".rl");
+	buf[m.size()] = '\0';
+
+	render_mnemonic(out, buf);
+	out << 'x' << get_rd(insn) << ',';
+	if (get_funct5(insn) != funct5_lr) out << 'x' << get_rs2(insn) << ',';
+	out << "(x" << get_rs1(insn) << ')';
+}
+
+// render a compressed instruction in RVC syntax: its compressed mnemonic
+// and the operands the encoding holds, taken from the instruction it
+// expands to, leaving out the registers it implies
+void rv32i_decode::render_compressed(text_buffer& out, uint32_t addr, uint16_t insn)
+{
+	const char* m;
+	uint32_t expanded = expand_compressed(insn, &m);
+	if (!expanded) return render_illegal_insn(out, insn);
+	render_mnemonic(out, m);
+	if (std::strcmp(m, "c.nop") == 0) return;
+
+	uint32_t rd = get_rd(expanded);
+	uint32_t rs1 = get_rs1(expanded);
+	switch (get_op(expanded)) {
+	default: break;
+	case op::lui:
+		out << 'x' << rd << ',' << hex0x20(uint32_t(get_imm_u(expanded)));
+		break;
+	case op::jal:
+		out << hex0x32(uint32_t(get_imm_j(expanded)));
+		break;
+	case op::jalr:
+		out << 'x' << rs1;
+		break;
+	case op::beq:
+	case op::bne:
+		out << 'x' << rs1 << ',' << hex0x32(get_imm_b(expanded) + addr);
+		break;
+	case op::lw:
+		out << 'x' << rd << ',' << get_imm_i(expanded) << "(x" << rs1 << ')';
+		break;
+	case op::sw:
+		out << 'x' << get_rs2(expanded) << ',' << get_imm_s(expanded) << "(x" << rs1 << ')';
+		break;
+	case op::addi:
+	case op::andi:
+		// c.addi4spn is the only one with a source other than rd or x0
+		out << 'x' << rd << ',';
+		if (rs1 != rd && rs1 != 0) out << 'x' << rs1 << ',';
+		out << get_imm_i(expanded);
+		break;
+	case op::slli:
+	case op::srli:
+	case op::srai:
+		out << 'x' << rd << ',' << get_imm_i(expanded) % XLEN;
+		break;
+	case op::add:
+	case op::sub:
+	case op::xor_:
+	case op::or_:
+	case op::and_:
+		out << 'x' << rd << ",x" << get_rs2(expanded);
+		break;
+	}
 }
 
 // render mnemonic
-std::string rv32i_decode::render_mnemonic(const std::string& m)
+void rv32i_decode::render_mnemonic(text_buffer& out, const char* m)
 {
-	std::ostringstream os;
-	os << std::setw(mnemonic_width) << std::setfill(' ') << std::left << m;
-	return os.str();
+	size_t start = out.size();
+	out << m;
+	if (out.size() - start >= mnemonic_width) out << ' ';
+	else out.pad(start + mnemonic_width);
 }
@@ -1,14 +1,87 @@
 #pragma once
 
 #include <string>
+#include <array>
+#include <cstdint>
 #include "hex.h"
+#include "text_buffer.h"
 
 class rv32i_decode : public hex
 {
 public:
 	///@parm addr The memory address where the insn is stored.
 	static std::string decode(uint32_t addr, uint32_t insn);
+	// As decode(), into out without allocating. No rendering is longer
+	// than decode_max.
+	static void decode(text_buffer& out, uint32_t addr, uint32_t insn);
+	static constexpr size_t decode_max = 64;
+
+	// Instructions whose low two bits are not 0b11 are 16 bits long.
+	static bool is_compressed(uint32_t insn) { return (insn & 3) != 3; }
+
+	// The 32-bit instruction a compressed one stands for, or 0 if it is
+	// reserved or needs an extension that is not implemented. mnemonic,
+	// if given, is set to the compressed mnemonic.
+	static uint32_t expand_compressed(uint16_t insn, const char** mnemonic = nullptr);
 protected:
+	// Every 32-bit instruction the decoder knows. The executor and the
+	// disassembler both start from get_op(), so they agree on what is
+	// legal. lui to remu are the ones the JIT translates.
+	enum class op : uint8_t {
+		illegal,
+		lui, auipc, jal, jalr,
+		beq, bne, blt, bge, bltu, bgeu,
+		lb, lh, lw, lbu, lhu,
+		sb, sh, sw,
+		addi, slti, sltiu, xori, ori, andi, slli, srli, srai,
+		add, sub, sll, slt, sltu, xor_, srl, sra, or_, and_,
+		mul, mulh, mulhsu, mulhu, div, divu, rem, remu,
+		ecall, ebreak,
+		csrrw, csrrs, csrrc, csrrwi, csrrsi, csrrci,
+		fence, fence_i,
+		lr_w, sc_w, amoswap_w, amoadd_w, amoxor_w, amoand_w, amoor_w,
+		amomin_w, amomax_w, amominu_w, amomaxu_w,
+		count
+	};
+
+	// How an instruction's operands are laid out, for rendering and for
+	// extracting its immediate
+	enum class format : uint8_t {
+		illegal, lui, auipc, jal, jalr, branch, load, store, alu_imm, shift_imm, rtype,
+		csr, csri, bare, fence, amo
+	};
+
+	struct op_info
+	{
+		const char* mnemonic;
+		format fmt;
+	};
+
+	static const op_info op_infos[];
+
+	// Indexed by opcode bits 6:2, funct3 and funct7, which tell apart
+	// every instruction but ecall/ebreak and lr.w; get_op() checks those.
+	static constexpr uint32_t op_table_size = 1 << 15;
+	static const std::array<op, op_table_size> op_table;
+	static constexpr std::array<op, op_table_size> make_op_table();
+
+	static uint32_t op_index(uint32_t insn) { return (insn >> 2 & 0x1f) | (insn >> 7 & 0xe0) | (insn >> 17 & 0x7f00); }
+	static op get_op(uint32_t insn)
+	{
+		op o = op_table[op_index(insn)];
+		if (o == op::ecall) return insn == insn_ecall ? op::ecall : insn == insn_ebreak ? op::ebreak : op::illegal;
+		if (o == op::lr_w && get_rs2(insn)) return op::illegal;
+		return o;
+	}
+
+	// The immediate of a 32-bit instruction as executing it needs it:
+	// sign-extended, U-type shifted into place, shift amounts mod XLEN and
+	// 0 for formats without one.
+	static int32_t get_imm(uint32_t insn, op o);
+
+	// Render a 32-bit instruction already looked up as o
+	static void render(text_buffer& out, uint32_t addr, uint32_t insn, op o);
+
 	static constexpr int mnemonic_width = 8;
 	static constexpr uint32_t opcode_lui = 0b0110111;
 	static constexpr uint32_t opcode_auipc = 0b0010111;
@@ -20,6 +93,8 @@ protected:
 	static constexpr uint32_t opcode_alu_imm = 0b0010011;
 	static constexpr uint32_t opcode_rtype = 0b0110011;
 	static constexpr uint32_t opcode_system = 0b1110011;
+	static constexpr uint32_t opcode_misc_mem = 0b0001111;
+	static constexpr uint32_t opcode_amo = 0b0101111;
 	static constexpr uint32_t funct3_beq = 0b000;
 	static constexpr uint32_t funct3_bne = 0b001;
 	static constexpr uint32_t funct3_blt = 0b100;
@@ -46,6 +121,15 @@ protected:
 	static constexpr uint32_t funct7_sra = 0b0100000;
 	static constexpr uint32_t funct7_add = 0b0000000;
 	static constexpr uint32_t funct7_sub = 0b0100000;
+	static constexpr uint32_t funct7_muldiv = 0b0000001;
+	static constexpr uint32_t funct3_mul = 0b000;
+	static constexpr uint32_t funct3_mulh = 0b001;
+	static constexpr uint32_t funct3_mulhsu = 0b010;
+	static constexpr uint32_t funct3_mulhu = 0b011;
+	static constexpr uint32_t funct3_div = 0b100;
+	static constexpr uint32_t funct3_divu = 0b101;
+	static constexpr uint32_t funct3_rem = 0b110;
+	static constexpr uint32_t funct3_remu = 0b111;
 	static constexpr uint32_t insn_ecall = 0x00000073;
 	static constexpr uint32_t insn_ebreak = 0x00100073;
 	static constexpr uint32_t funct3_csrrw = 0b001;
@@ -54,35 +138,52 @@ protected:
 	static constexpr uint32_t funct3_csrrwi = 0b101;
 	static constexpr uint32_t funct3_csrrsi = 0b110;
 	static constexpr uint32_t funct3_csrrci = 0b111;
+	static constexpr uint32_t funct3_fence = 0b000;
+	static constexpr uint32_t funct3_fence_i = 0b001;
+	static constexpr uint32_t csr_mhartid = 0xf14;
+	static constexpr uint32_t funct3_amo_w = 0b010;
+	static constexpr uint32_t funct5_lr = 0b00010;
+	static constexpr uint32_t funct5_sc = 0b00011;
+	static constexpr uint32_t funct5_amoswap = 0b00001;
+	static constexpr uint32_t funct5_amoadd = 0b00000;
+	static constexpr uint32_t funct5_amoxor = 0b00100;
+	static constexpr uint32_t funct5_amoand = 0b01100;
+	static constexpr uint32_t funct5_amoor = 0b01000;
+	static constexpr uint32_t funct5_amomin = 0b10000;
+	static constexpr uint32_t funct5_amomax = 0b10100;
+	static constexpr uint32_t funct5_amominu = 0b11000;
+	static constexpr uint32_t funct5_amomaxu = 0b11100;
 	static uint32_t get_opcode(uint32_t insn);
 	static uint32_t get_rd(uint32_t insn);
 	static uint32_t get_funct3(uint32_t insn);
 	static uint32_t get_rs1(uint32_t insn);
 	static uint32_t get_rs2(uint32_t insn);
 	static uint32_t get_funct7(uint32_t insn);
+	static uint32_t get_funct5(uint32_t insn);
 	static int32_t get_imm_i(uint32_t insn);
 	static int32_t get_imm_u(uint32_t insn);
 	static int32_t get_imm_b(uint32_t insn);
 	static int32_t get_imm_s(uint32_t insn);
 	static int32_t get_imm_j(uint32_t insn);
 	static constexpr uint32_t XLEN = 32;
-	static std::string render_illegal_insn(uint32_t insn);
-	static std::string render_lui(uint32_t insn);
-	static std::string render_auipc(uint32_t insn);
+	static void render_illegal_insn(text_buffer& out, uint32_t insn);
+	static void render_lui(text_buffer& out, uint32_t insn);
+	static void render_auipc(text_buffer& out, uint32_t insn);
 	///@parm addr The memory address where the insn is stored.
-	static std::string render_jal(uint32_t addr, uint32_t insn);
-	static std::string render_jalr(uint32_t insn);
+	static void render_jal(text_buffer& out, uint32_t addr, uint32_t insn);
+	static void render_jalr(text_buffer& out, uint32_t insn);
 	///@parm addr The memory address where the insn is stored.
-	static std::string render_btype(uint32_t addr, uint32_t insn, const char* mnemonic);
-	static std::string render_itype_load(uint32_t insn, const char* mnemonic);
-	static std::string render_stype(uint32_t insn, const char* mnemonic);
-	static std::string render_itype_alu(uint32_t insn, const char* mnemonic, int32_t imm_i);
-	static std::string render_rtype(uint32_t insn, const char* mnemonic);
-	static std::string render_ecall(uint32_t insn);
-	static std::string render_ebreak(uint32_t insn);
-	static std::string render_csrrx(uint32_t insn, const char* mnemonic);
-	static std::string render_csrrxi(uint32_t insn, const char* mnemonic);
-	static std::string render_reg(int r);
-	static std::string render_base_disp(uint32_t base, int32_t disp);
-	static std::string render_mnemonic(const std::string& m);
+	static void render_btype(text_buffer& out, uint32_t addr, uint32_t insn, const char* mnemonic);
+	static void render_itype_load(text_buffer& out, uint32_t insn, const char* mnemonic);
+	static void render_stype(text_buffer& out, uint32_t insn, const char* mnemonic);
+	static void render_itype_alu(text_buffer& out, uint32_t insn, const char* mnemonic, int32_t imm_i);
+	static void render_rtype(text_buffer& out, uint32_t insn, const char* mnemonic);
+	static void render_ecall(text_buffer& out, uint32_t insn);
+	static void render_ebreak(text_buffer& out, uint32_t insn);
+	static void render_csrrx(text_buffer& out, uint32_t insn, const char* mnemonic);
+	static void render_csrrxi(text_buffer& out, uint32_t insn, const char* mnemonic);
+	static void render_fence(text_buffer& out, uint32_t insn);
+	static void render_amo(text_buffer& out, uint32_t insn, const char* mnemonic);
+	static void render_compressed(text_buffer& out, uint32_t addr, uint16_t insn);
+	static void render_mnemonic(text_buffer& out, const char* m);
 };
\ No newline at end of file
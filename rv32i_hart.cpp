@@ -1,24 +1,79 @@
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
 #include "rv32i_hart.h"
 
 void rv32i_hart::tick(const std::string& hdr)
 {
 	if (halt) return;
 
-	insn_counter++;
-	if (show_registers) dump();
-	uint32_t insn = mem.get32(pc);
-	if (show_instructions) {
-		std::cout << hex::to_hex32(pc) << ": " << hex::to_hex32(insn) << "  ";
-		exec(insn, &std::cout);
-		std::cout << std::endl;
+	set_icache_trace(show_instructions);
+	if (insn_log || flow_log || prof || stacks || l1i || l1d) {
+		if (show_instructions) show_registers ? step<true, true, true>() : step<true, false, true>();
+		else show_registers ? step<false, true, true>() : step<false, false, true>();
+	}
+	else {
+		if (show_instructions) show_registers ? step<true, true, false>() : step<true, false, false>();
+		else show_registers ? step<false, true, false>() : step<false, false, false>();
+	}
+}
 
+// Execute until the hart halts or exec_limit (0 = no limit) is reached,
+// with the trace options checked once here rather than per instruction.
+void rv32i_hart::interpret(uint64_t exec_limit)
+{
+	set_icache_trace(show_instructions);
+	if (insn_log || flow_log || prof || stacks || l1i || l1d) {
+		if (show_instructions) show_registers ? interpret<true, true, true>(exec_limit) : interpret<true, false, true>(exec_limit);
+		else show_registers ? interpret<false, true, true>(exec_limit) : interpret<false, false, true>(exec_limit);
 	}
 	else {
-		exec(insn, nullptr);
+		if (show_instructions) show_registers ? interpret<true, true, false>(exec_limit) : interpret<true, false, false>(exec_limit);
+		else show_registers ? interpret<false, true, false>(exec_limit) : interpret<false, false, false>(exec_limit);
 	}
+}
 
+template<bool trace_insns, bool trace_regs, bool record> void rv32i_hart::interpret(uint64_t exec_limit)
+{
+	while (!halt && (exec_limit == 0 || insn_counter < exec_limit)) step<trace_insns, trace_regs, record>();
+}
+
+template<bool trace_insns, bool trace_regs, bool record> inline void rv32i_hart::step()
+{
+	insn_counter++;
+	if constexpr (trace_regs) dump();
+	const decoded_insn& di = fetch(pc);
+	// the handler may invalidate di's icache entry
+	const uint32_t at = pc, insn = di.insn, rd = di.rd, rs1 = di.rs1, next = pc + di.len;
+	const op o = di.o;
+	if constexpr (record) {
+		if (l1i) l1i->access(at, di.len, false);
+		if (l1d) access_data(di);
+	}
+	if constexpr (trace_insns) {
+		trace_line.clear();
+		trace_line << hex32(pc) << ": ";
+		if (di.len == 2) trace_line << "    " << hex16(di.insn);
+		else trace_line << hex32(di.insn);
+		trace_line << "  ";
+		(this->*di.exec)(di);
+		trace_line << '\n';
+		trace_os->write(trace_line.data(), trace_line.size());
+	}
+	else {
+		(this->*di.exec)(di);
+	}
+	if constexpr (record) {
+		if (insn_log) insn_log->append(at, insn, regs.get(rd));
+		if (flow_log) log_flow(o, next);
+		if (prof) prof->count(at, o);
+		if (stacks) {
+			track_calls(o, rd, rs1, next);
+			stacks->tick(pc, insn_counter);
+		}
+	}
 }
 
 void rv32i_hart::dump(const std::string& hdr) const
@@ -34,626 +89,932 @@ void rv32i_hart::reset()
 	insn_counter = 0;
 	halt = false;
 	halt_reason = "none";
+	invalidate_icache();
 }
 
-void rv32i_hart::exec_ebreak(uint32_t insn, std::ostream* pos)
+rv32i_hart::state rv32i_hart::save_state() const
 {
-	if (pos)
-	{
-	 std::string s = render_ebreak(insn);
-	 *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-	 *pos << "// HALT ";
-	 }
-	halt = true;
-	halt_reason = "EBREAK instruction";
+	return { regs, pc, insn_counter, halt, halt_reason };
 }
 
-void rv32i_hart::exec(uint32_t insn, std::ostream* pos)
-{
-	uint32_t opcode = get_opcode(insn);
-	if (insn == insn_ebreak) return exec_ebreak(insn, pos);
-
-	switch (opcode) {
-	default: exec_illegal_insn(insn, pos); return;
-	case opcode_lui: return exec_lui(insn, pos);
-	case opcode_auipc: return exec_auipc(insn, pos);
-	case opcode_jal: return exec_jal(insn, pos);
-	case opcode_jalr: return exec_jalr(insn, pos);
-
-	case opcode_btype:
-		switch (get_funct3(insn))
-		{
-		default: return exec_illegal_insn(insn, pos);
-		case funct3_beq: return exec_beq(insn, pos);
-		case funct3_bne: return exec_bne(insn, pos);
-		case funct3_blt: return exec_blt(insn, pos);
-		case funct3_bge: return exec_bge(insn, pos);
-		case funct3_bltu: return exec_bltu(insn, pos);
-		case funct3_bgeu: return exec_bgeu(insn, pos);
-		}
+void rv32i_hart::restore_state(const state& s)
+{
+	regs = s.regs;
+	pc = s.pc;
+	insn_counter = s.insn_counter;
+	halt = s.halt;
+	halt_reason = s.halt_reason;
+	reserved = false;
+}
+
+// The icache holds handlers for one trace setting, so changing it
+// empties the cache.
+void rv32i_hart::set_icache_trace(bool trace)
+{
+	if (trace == icache_trace) return;
+	for (icache_entry& e : icache) e.addr = icache_invalid;
+	icache_trace = trace;
+}
+
+void rv32i_hart::invalidate_icache()
+{
+	for (icache_entry& e : icache) e.addr = icache_invalid;
+	if (!blocks.empty()) blocks_stale = true;
+	set_predecoded({});
+}
+
+rv32i_hart::~rv32i_hart()
+{
+	if (flow_log) flow_log->finish(insn_counter - flow_start);
+}
+
+bool rv32i_hart::set_flow_file(const std::string& fname)
+{
+	flow_log = std::make_unique<flow_trace>(fname, pc);
+	flow_start = insn_counter;
+	if (flow_log->is_open()) return true;
+	flow_log.reset();
+	return false;
+}
+
+void rv32i_hart::set_profile(bool b)
+{
+	if (!b) prof.reset();
+	else if (!prof) prof = std::make_unique<profile>();
+}
+
+bool rv32i_hart::set_stack_file(const std::string& fname, uint64_t interval)
+{
+	stacks = std::make_unique<stack_sampler>(fname, mem, interval, pc, insn_counter);
+	if (stacks->is_open()) return true;
+	stacks.reset();
+	return false;
+}
+
+void rv32i_hart::set_cache_models(const cache_model::config* i, const cache_model::config* d)
+{
+	l1i.reset(i ? new cache_model(*i) : nullptr);
+	l1d.reset(d ? new cache_model(*d) : nullptr);
+}
 
-	case opcode_load_imm:
-		switch (get_funct3(insn))
-		{
-		default: return exec_illegal_insn(insn, pos);
-		case funct3_lb: return exec_lb(insn, pos);
-		case funct3_lh: return exec_lh(insn, pos);
-		case funct3_lw: return exec_lw(insn, pos);
-		case funct3_lbu: return exec_lbu(insn, pos);
-		case funct3_lhu: return exec_lhu(insn, pos);
+// Look up what di is about to load or store in the data cache
+void rv32i_hart::access_data(const decoded_insn& di)
+{
+	uint32_t len = 4;
+	bool write = false;
+	switch (di.o) {
+	case op::lb: case op::lbu: len = 1; break;
+	case op::lh: case op::lhu: len = 2; break;
+	case op::lw: case op::lr_w: break;
+	case op::sb: len = 1; write = true; break;
+	case op::sh: len = 2; write = true; break;
+	case op::sw: write = true; break;
+	default:
+		if (op_infos[size_t(di.o)].fmt != format::amo) return;
+		write = true;
+		break;
+	}
+	l1d->access(regs.get(di.rs1) + di.imm, len, write);
+}
+
+bool rv32i_hart::set_trace_file(const std::string& fname)
+{
+	insn_log = std::make_unique<trace_log>(fname);
+	if (insn_log->is_open()) return true;
+	insn_log.reset();
+	return false;
+}
+
+void rv32i_hart::set_predecoded(const std::vector<std::shared_ptr<const rv32i_predecode>>& p)
+{
+	predecoded = p;
+	predecoded_lo = UINT64_MAX;
+	predecoded_hi = 0;
+	for (const auto& r : predecoded) {
+		predecoded_lo = std::min<uint64_t>(predecoded_lo, r->get_start());
+		predecoded_hi = std::max(predecoded_hi, r->get_end());
+	}
+}
+
+void rv32i_hart::drop_predecoded(uint32_t addr, uint32_t len)
+{
+	std::vector<std::shared_ptr<const rv32i_predecode>> keep;
+	for (const auto& r : predecoded) {
+		if (addr + uint64_t(len) <= r->get_start() || addr >= r->get_end()) keep.push_back(r);
+	}
+	set_predecoded(keep);
+}
+
+// Drop any cached decode of an instruction overlapping a store of len
+// bytes at addr, including a 32-bit one that starts in the halfword before.
+void rv32i_hart::invalidate_icache(uint32_t addr, uint32_t len)
+{
+	uint32_t first = (addr & ~1u) - 2;
+	uint32_t last = (addr + len - 1) & ~1u;
+	for (uint32_t a = first; a != last + 2; a += 2) {
+		icache_entry& e = icache[(a >> 1) & (icache_size - 1)];
+		if (e.addr == a) e.addr = icache_invalid;
+	}
+
+	// translated blocks are dropped wholesale at the next block boundary.
+	// translate() marks every page an instruction touches, so only the
+	// pages of the stored bytes matter.
+	if (!blocks.empty() && (code_pages[addr >> code_page_shift] || code_pages[(addr + len - 1) >> code_page_shift]))
+		blocks_stale = true;
+
+	if (addr + uint64_t(len) > predecoded_lo && addr < predecoded_hi) drop_predecoded(addr, len);
+}
+
+// Append the disassembly of insn to the trace line, padded to its column.
+void rv32i_hart::trace_insn(uint32_t addr, uint32_t insn)
+{
+	size_t start = trace_line.size();
+	decode(trace_line, addr, insn);
+	trace_line.pad(start + instruction_width);
+}
+
+// Fetch the 16 or 32 bits of the instruction at addr.
+// With the reserved backing an address past the end reads as zero, as it
+// does paged, rather than faulting inside translate() or the icache.
+uint32_t rv32i_hart::fetch_insn(uint32_t addr) const
+{
+	bool reserved = mem.host_base();
+	if (reserved && mem.check_illegal(addr)) return 0;
+	uint32_t insn = mem.get16(addr);
+	if (is_compressed(insn) || (reserved && mem.check_illegal(addr + 2))) return insn;
+	return insn | uint32_t(mem.get16(addr + 2)) << 16;
+}
+
+// Decode the instruction at addr, taking its fields from a predecoded
+// range if one holds it.
+template<bool trace> rv32i_hart::decoded_insn rv32i_hart::decode_at(uint32_t addr) const
+{
+	for (const auto& r : predecoded) {
+		if (!r->covers(addr)) continue;
+		size_t i = r->index(addr);
+		if (!is_compressed(r->insn[i])) return predecode<trace>(*r, i);
+		break;
+	}
+	return predecode<trace>(fetch_insn(addr));
+}
+
+const rv32i_hart::decoded_insn& rv32i_hart::fetch(uint32_t addr)
+{
+	icache_entry& e = icache[(addr >> 1) & (icache_size - 1)];
+	if (e.addr != addr) {
+		e.di = icache_trace ? decode_at<true>(addr) : decode_at<false>(addr);
+		e.addr = addr;
+	}
+	return e.di;
+}
+
+// Blocks only ever hold untraced handlers.
+bool rv32i_hart::is_block_end(const decoded_insn& di)
+{
+	return di.exec == &rv32i_hart::exec_beq<false> || di.exec == &rv32i_hart::exec_bne<false>
+		|| di.exec == &rv32i_hart::exec_blt<false> || di.exec == &rv32i_hart::exec_bge<false>
+		|| di.exec == &rv32i_hart::exec_bltu<false> || di.exec == &rv32i_hart::exec_bgeu<false>
+		|| di.exec == &rv32i_hart::exec_jal<false> || di.exec == &rv32i_hart::exec_jalr<false>
+		|| di.exec == &rv32i_hart::exec_ebreak<false> || di.exec == &rv32i_hart::exec_illegal_insn<false>;
+}
+
+rv32i_hart::block* rv32i_hart::translate(uint32_t addr)
+{
+	if (code_pages.empty()) code_pages.resize(size_t(1) << (32 - code_page_shift));
+
+	std::unique_ptr<block> b = std::make_unique<block>();
+	b->addr = addr;
+	for (uint32_t a = addr; ; ) {
+		b->insns.push_back(decode_at<false>(a));
+		code_pages[a >> code_page_shift] = true;
+		code_pages[(a + b->insns.back().len - 1) >> code_page_shift] = true;
+		a += b->insns.back().len;
+		if (is_block_end(b->insns.back()) || b->insns.size() == max_block_insns) {
+			b->next = a;
+			break;
 		}
+	}
+
+	block* p = b.get();
+	blocks[addr] = std::move(b);
+	return p;
+}
+
+rv32i_hart::block* rv32i_hart::lookup_block(uint32_t addr)
+{
+	auto it = blocks.find(addr);
+	return it != blocks.end() ? it->second.get() : translate(addr);
+}
+
+// Follow (or create) the chain from a block to the block at addr.
+rv32i_hart::block* rv32i_hart::link_block(block* from, uint32_t addr)
+{
+	if (from->link[0] && from->link[0]->addr == addr) return from->link[0];
+	if (from->link[1] && from->link[1]->addr == addr) return from->link[1];
 
-	case opcode_stype:
-		switch (get_funct3(insn))
-		{
-		default: return exec_illegal_insn(insn, pos);
-		case funct3_sb: return exec_sb(insn, pos);
-		case funct3_sh: return exec_sh(insn, pos);
-		case funct3_sw: return exec_sw(insn, pos);
+	block* to = lookup_block(addr);
+	from->link[from->link[0] ? 1 : 0] = to;
+	return to;
+}
+
+void rv32i_hart::flush_blocks()
+{
+	blocks.clear();
+	std::fill(code_pages.begin(), code_pages.end(), false);
+	blocks_stale = false;
+	if (jit) jit->flush();
+}
+
+// Run a block to its end, or up to a store that made it stale.
+void rv32i_hart::exec_block(const block* b)
+{
+	const decoded_insn* first = b->insns.data();
+	const decoded_insn* end = first + b->insns.size();
+	const decoded_insn* di = first;
+	running = b;
+	do {
+		(this->*di->exec)(*di);
+	} while (++di != end && !blocks_stale && !halt);
+	running = nullptr;
+	insn_counter += di - first;
+}
+
+void rv32i_hart::count_faulted_block()
+{
+	if (!running) return;
+	uint32_t addr = running->addr;
+	for (const decoded_insn& di : running->insns) {
+		insn_counter++;
+		if (addr == pc) break;
+		addr += di.len;
+	}
+	running = nullptr;
+}
+
+// Count the first n instructions of b, which have just run
+void rv32i_hart::profile_block(const block* b, size_t n)
+{
+	uint32_t a = b->addr;
+	for (size_t i = 0; i < n; i++) {
+		prof->count(a, b->insns[i].o);
+		a += b->insns[i].len;
+	}
+}
+
+// Execute whole basic blocks until the hart halts or the next block would
+// run past exec_limit (0 = no limit). Whatever is left is for tick().
+void rv32i_hart::run_blocks(uint64_t exec_limit)
+{
+	if (blocks_stale) flush_blocks();
+
+	block* b = halt ? nullptr : lookup_block(pc);
+	while (!halt) {
+		if (exec_limit && insn_counter + b->insns.size() > exec_limit) return;
+
+		uint64_t before = insn_counter;
+		exec_block(b);
+		// a block that went stale or halted stopped short of its end
+		bool ran_all = !blocks_stale && !halt;
+		if (flow_log && ran_all) log_flow(b->insns.back().o, b->next);
+		if (prof) profile_block(b, insn_counter - before);
+		if (stacks) {
+			const decoded_insn& last = b->insns.back();
+			if (ran_all) track_calls(last.o, last.rd, last.rs1, b->next);
+			stacks->tick(pc, insn_counter);
 		}
+		if (halt) return;
 
-	case opcode_alu_imm:
-		switch (get_funct3(insn))
-		{
-		default: return exec_illegal_insn(insn, pos);
-		case funct3_add: return exec_addi(insn, pos);
-		case funct3_slt: return exec_slti(insn, pos);
-		case funct3_sltu: return exec_sltiu(insn, pos);
-		case funct3_xor: return exec_xori(insn, pos);
-		case funct3_or: return exec_ori(insn, pos);
-		case funct3_and: return exec_andi(insn, pos);
-		case funct3_sll: return exec_slli(insn, pos);
-		case funct3_srx:
-			switch (get_funct7(insn))
-			{
-			default: return exec_illegal_insn(insn, pos);
-			case funct7_sra: return exec_srai(insn, pos);
-			case funct7_srl: return exec_srli(insn, pos);
-			}
+		if (blocks_stale) {
+			flush_blocks();
+			b = lookup_block(pc);
+		}
+		else {
+			b = link_block(b, pc);
+		}
+	}
+}
 
-			
+// Like run_blocks(), but blocks that have run jit_threshold times are
+// compiled to native code, which then runs until it has to come back here.
+void rv32i_hart::run_jit(uint64_t exec_limit)
+{
+	// native code does not report branch outcomes, calls or what it ran
+	if (flow_log || prof || stacks) return run_blocks(exec_limit);
+	if (!jit) jit = std::make_unique<rv32i_jit>(this);
+	if (!jit->is_available()) return run_blocks(exec_limit);
+	if (blocks_stale) flush_blocks();
+
+	while (!halt) {
+		uint64_t remaining = exec_limit ? exec_limit - insn_counter : INT64_MAX;
+
+		if (uint8_t* native = jit->lookup(pc)) {
+			int64_t budget = remaining;
+			pc = jit->enter(native, budget);
+			insn_counter += remaining - budget;
+			if (blocks_stale) flush_blocks();
+			if (uint64_t(budget) == remaining) return;
+			continue;
 		}
 
-	case opcode_rtype:
-		switch (get_funct3(insn))
-		{
-		default: return exec_illegal_insn(insn, pos);
-		case funct3_add: return exec_add(insn, pos);
-		case funct3_and: return exec_and(insn, pos);
-		case funct3_or: return exec_or(insn, pos);
-		case funct3_sll: return exec_sll(insn, pos);
-		case funct3_slt: return exec_slt(insn, pos);
-		case funct3_sltu: return exec_sltu(insn, pos);
-		case funct3_xor: return exec_xor(insn, pos);
-		case funct3_srx:
-			switch (get_funct7(insn))
-			{
-			default: return exec_illegal_insn(insn, pos);
-			case funct7_sra: return exec_sra(insn, pos);
-			case funct7_srl: return exec_srl(insn, pos);
+		block* b = lookup_block(pc);
+		if (b->insns.size() > remaining) return;
+
+		exec_block(b);
+		if (blocks_stale) {
+			flush_blocks();
+		}
+		else if (++b->hits == jit_threshold) {
+			// a full jit starts over, and the blocks it dropped count
+			// their way back up to the threshold
+			if (jit->is_full()) {
+				jit->flush();
+				for (auto& [addr, other] : blocks) other->hits = 0;
 			}
-			
+			std::vector<uint32_t> words;
+			for (const decoded_insn& di : b->insns) words.push_back(di.insn);
+			jit->compile(b->addr, words);
 		}
+	}
+}
 
-	case opcode_system:
-		switch (get_funct3(insn))
-		{
-		default: return exec_illegal_insn(insn, pos);
-		case funct3_csrrw: return exec_csrrs(insn, pos);
-		case funct3_csrrs: return exec_csrrs(insn, pos);
-		case funct3_csrrc: return exec_csrrs(insn, pos);
-		case funct3_csrrwi: return exec_csrrs(insn, pos);
-		case funct3_csrrsi: return exec_csrrs(insn, pos);
-		case funct3_csrrci: return exec_csrrs(insn, pos);
-		}
+template<bool trace> void rv32i_hart::exec_ebreak(const decoded_insn& di)
+{
+	if constexpr (trace)
+	{
+	 size_t start = trace_line.size();
+	 render_ebreak(trace_line, di.insn);
+	 trace_line.pad(start + instruction_width);
+	 trace_line << "// HALT ";
+	 }
+	halt = true;
+	halt_reason = "EBREAK instruction";
+}
+
+// In the order of rv32i_decode::op. ecall is not implemented.
+template<bool trace> const rv32i_hart::handler rv32i_hart::handlers[] = {
+	&rv32i_hart::exec_illegal_insn<trace>,
+	&rv32i_hart::exec_lui<trace>, &rv32i_hart::exec_auipc<trace>, &rv32i_hart::exec_jal<trace>, &rv32i_hart::exec_jalr<trace>,
+	&rv32i_hart::exec_beq<trace>, &rv32i_hart::exec_bne<trace>, &rv32i_hart::exec_blt<trace>,
+	&rv32i_hart::exec_bge<trace>, &rv32i_hart::exec_bltu<trace>, &rv32i_hart::exec_bgeu<trace>,
+	&rv32i_hart::exec_lb<trace>, &rv32i_hart::exec_lh<trace>, &rv32i_hart::exec_lw<trace>,
+	&rv32i_hart::exec_lbu<trace>, &rv32i_hart::exec_lhu<trace>,
+	&rv32i_hart::exec_sb<trace>, &rv32i_hart::exec_sh<trace>, &rv32i_hart::exec_sw<trace>,
+	&rv32i_hart::exec_addi<trace>, &rv32i_hart::exec_slti<trace>, &rv32i_hart::exec_sltiu<trace>,
+	&rv32i_hart::exec_xori<trace>, &rv32i_hart::exec_ori<trace>, &rv32i_hart::exec_andi<trace>,
+	&rv32i_hart::exec_slli<trace>, &rv32i_hart::exec_srli<trace>, &rv32i_hart::exec_srai<trace>,
+	&rv32i_hart::exec_add<trace>, &rv32i_hart::exec_sub<trace>, &rv32i_hart::exec_sll<trace>,
+	&rv32i_hart::exec_slt<trace>, &rv32i_hart::exec_sltu<trace>, &rv32i_hart::exec_xor<trace>,
+	&rv32i_hart::exec_srl<trace>, &rv32i_hart::exec_sra<trace>, &rv32i_hart::exec_or<trace>, &rv32i_hart::exec_and<trace>,
+	&rv32i_hart::exec_mul<trace>, &rv32i_hart::exec_mulh<trace>, &rv32i_hart::exec_mulhsu<trace>, &rv32i_hart::exec_mulhu<trace>,
+	&rv32i_hart::exec_div<trace>, &rv32i_hart::exec_divu<trace>, &rv32i_hart::exec_rem<trace>, &rv32i_hart::exec_remu<trace>,
+	&rv32i_hart::exec_illegal_insn<trace>, &rv32i_hart::exec_ebreak<trace>,
+	&rv32i_hart::exec_csrrw<trace>, &rv32i_hart::exec_csrrs<trace>, &rv32i_hart::exec_csrrc<trace>,
+	&rv32i_hart::exec_csrrwi<trace>, &rv32i_hart::exec_csrrsi<trace>, &rv32i_hart::exec_csrrci<trace>,
+	&rv32i_hart::exec_fence<trace>, &rv32i_hart::exec_fence_i<trace>,
+	&rv32i_hart::exec_lr_w<trace>, &rv32i_hart::exec_sc_w<trace>, &rv32i_hart::exec_amoswap_w<trace>,
+	&rv32i_hart::exec_amoadd_w<trace>, &rv32i_hart::exec_amoxor_w<trace>, &rv32i_hart::exec_amoand_w<trace>,
+	&rv32i_hart::exec_amoor_w<trace>, &rv32i_hart::exec_amomin_w<trace>, &rv32i_hart::exec_amomax_w<trace>,
+	&rv32i_hart::exec_amominu_w<trace>, &rv32i_hart::exec_amomaxu_w<trace>,
+};
+
+template<bool trace> rv32i_hart::decoded_insn rv32i_hart::predecode(uint32_t insn)
+{
+	static_assert(sizeof(handlers<trace>) / sizeof(handler) == size_t(op::count), "handlers must cover every op");
+
+	decoded_insn di;
+	if (is_compressed(insn)) {
+		uint32_t expanded = expand_compressed(insn);
+		if (expanded) di = predecode<trace>(expanded);
+		else di = { &rv32i_hart::exec_illegal_insn<trace>, 0, 0, 0, 0, 0, 0, op::illegal };
+		di.insn = insn & 0xffff;
+		di.len = 2;
+		return di;
 	}
 
+	op o = get_op(insn);
+	di.exec = handlers<trace>[size_t(o)];
+	di.insn = insn;
+	di.rd = get_rd(insn);
+	di.rs1 = get_rs1(insn);
+	di.rs2 = get_rs2(insn);
+	di.imm = get_imm(insn, o);
+	di.len = 4;
+	di.o = o;
+	return di;
+}
 
+// As predecode() for entry i of p, with the fields already extracted
+template<bool trace> rv32i_hart::decoded_insn rv32i_hart::predecode(const rv32i_predecode& p, size_t i)
+{
+	op o = p.ops[i];
+	decoded_insn di = { handlers<trace>[size_t(o)], p.insn[i], 0, p.rd[i], p.rs1[i], p.rs2[i], 4, o };
+
+	switch (op_infos[size_t(o)].fmt) {
+	default: break;
+	case format::lui:
+	case format::auipc: di.imm = p.imm_u[i]; break;
+	case format::jal: di.imm = p.imm_j[i]; break;
+	case format::branch: di.imm = p.imm_b[i]; break;
+	case format::store: di.imm = p.imm_s[i]; break;
+	case format::shift_imm: di.imm = p.imm_i[i] % XLEN; break;
+	case format::jalr:
+	case format::load:
+	case format::alu_imm:
+	case format::csr:
+	case format::csri: di.imm = p.imm_i[i]; break;
+	}
+	return di;
 }
 
-void rv32i_hart::exec_lui(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_lui(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_u(insn) << 12;
+	uint32_t rd = di.rd;
+	int32_t imm_u = di.imm;
 	
 	regs.set(rd, imm_u);
 
-	if (pos) {
-		std::string s = decode(0, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(imm_u);
+	if constexpr (trace) {
+		trace_insn(0, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(imm_u);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_auipc(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_auipc(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_u(insn) << 12;
+	uint32_t rd = di.rd;
+	int32_t imm_u = di.imm;
 
 	regs.set(rd, imm_u + pc);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(pc) << " + " << to_hex0x32(imm_u) << " = " << to_hex0x32(imm_u + pc);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(pc) << " + " << hex0x32(imm_u) << " = " << hex0x32(imm_u + pc);
 	}
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_jal(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_jal(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_j(insn);
+	uint32_t rd = di.rd;
+	int32_t imm_u = di.imm;
 
-	regs.set(rd, pc + 4);
+	regs.set(rd, pc + di.len);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(pc + 4) << ", pc = " << to_hex0x32(pc) << " + " << to_hex0x32(imm_u) << " = " << to_hex0x32(imm_u);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(pc + di.len) << ", pc = " << hex0x32(pc) << " + " << hex0x32(imm_u) << " = " << hex0x32(pc + imm_u);
 	}
 	pc += imm_u;
 }
 
-void rv32i_hart::exec_jalr(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_jalr(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs = di.rs1;
+	int32_t imm_u = di.imm;
 
 	
 	uint32_t rs_value = regs.get(rs);
-	regs.set(rd, pc + 4);
+	regs.set(rd, pc + di.len);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(pc + 4) << ", pc = (" << to_hex0x32(imm_u) << " + " << to_hex0x32(rs_value) << ") & " << to_hex0x32(0xfffffffe) << " = " << to_hex0x32((imm_u + rs_value) & 0xfffffffe);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(pc + di.len) << ", pc = (" << hex0x32(imm_u) << " + " << hex0x32(rs_value) << ") & " << hex0x32(0xfffffffe) << " = " << hex0x32((imm_u + rs_value) & 0xfffffffe);
 	}
 	pc = (imm_u + rs_value) & 0xfffffffe;
 }
 
-void rv32i_hart::exec_bne(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_bne(const decoded_insn& di)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+	uint32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
 
-	uint32_t pc_increment = rs1_value != rs2_value ? imm_u : 4;
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// pc += (" << to_hex0x32(rs1_value) << " != " << to_hex0x32(rs2_value) << " ? " << to_hex0x32(imm_u) << " : 4) = " << to_hex0x32(pc_increment + pc);
+	uint32_t pc_increment = rs1_value != rs2_value ? imm_u : di.len;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// pc += (" << hex0x32(rs1_value) << " != " << hex0x32(rs2_value) << " ? " << hex0x32(imm_u) << " : " << uint32_t(di.len) << ") = " << hex0x32(pc_increment + pc);
 	}
 	pc += pc_increment;
 }
 
-void rv32i_hart::exec_blt(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_blt(const decoded_insn& di)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+	uint32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
 
-	uint32_t pc_increment = rs1_value < rs2_value ? imm_u : 4;
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// pc += (" << to_hex0x32(rs1_value) << " < " << to_hex0x32(rs2_value) << " ? " << to_hex0x32(imm_u) << " : 4) = " << to_hex0x32(pc_increment + pc);
+	uint32_t pc_increment = rs1_value < rs2_value ? imm_u : di.len;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// pc += (" << hex0x32(rs1_value) << " < " << hex0x32(rs2_value) << " ? " << hex0x32(imm_u) << " : " << uint32_t(di.len) << ") = " << hex0x32(pc_increment + pc);
 	}
 	pc += pc_increment;
 }
 
-void rv32i_hart::exec_bge(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_bge(const decoded_insn& di)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+	uint32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
 
-	int32_t pc_increment = rs1_value >= rs2_value ? imm_u : 4;
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// pc += (" << to_hex0x32(rs1_value) << " >= " << to_hex0x32(rs2_value) << " ? " << to_hex0x32(imm_u) << " : 4) = " << to_hex0x32(pc_increment + pc);
+	int32_t pc_increment = rs1_value >= rs2_value ? imm_u : di.len;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// pc += (" << hex0x32(rs1_value) << " >= " << hex0x32(rs2_value) << " ? " << hex0x32(imm_u) << " : " << uint32_t(di.len) << ") = " << hex0x32(pc_increment + pc);
 	}
 	pc += pc_increment;
 }
 
-void rv32i_hart::exec_bltu(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_bltu(const decoded_insn& di)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+	uint32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2);
 
-	uint32_t pc_increment = (unsigned)rs1_value < (unsigned)rs2_value ? imm_u : 4;
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// pc += (" << to_hex0x32(rs1_value) << " <U " << to_hex0x32(rs2_value) << " ? " << to_hex0x32(imm_u) << " : 4) = " << to_hex0x32(pc_increment + pc);
+	uint32_t pc_increment = (unsigned)rs1_value < (unsigned)rs2_value ? imm_u : di.len;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// pc += (" << hex0x32(rs1_value) << " <U " << hex0x32(rs2_value) << " ? " << hex0x32(imm_u) << " : " << uint32_t(di.len) << ") = " << hex0x32(pc_increment + pc);
 	}
 	pc += pc_increment;
 }
 
-void rv32i_hart::exec_bgeu(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_bgeu(const decoded_insn& di)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+	uint32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2);
 
-	uint32_t pc_increment = (unsigned)rs1_value >= (unsigned)rs2_value ? imm_u : 4;
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// pc += (" << to_hex0x32(rs1_value) << " >=U " << to_hex0x32(rs2_value) << " ? " << to_hex0x32(imm_u) << " : 4) = " << to_hex0x32(pc_increment + pc);
+	uint32_t pc_increment = (unsigned)rs1_value >= (unsigned)rs2_value ? imm_u : di.len;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// pc += (" << hex0x32(rs1_value) << " >=U " << hex0x32(rs2_value) << " ? " << hex0x32(imm_u) << " : " << uint32_t(di.len) << ") = " << hex0x32(pc_increment + pc);
 	}
 	pc += pc_increment;
 }
 
-void rv32i_hart::exec_beq(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_beq(const decoded_insn& di)
 {
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t imm_u = get_imm_b(insn);
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+	uint32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2);
 
-	uint32_t pc_increment = rs1_value == rs2_value ? imm_u : 4;
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// pc += (" << to_hex0x32(rs1_value) << " == " << to_hex0x32(rs2_value) << " ? " << to_hex0x32(imm_u) << " : 4) = " << to_hex0x32(pc_increment + pc);
+	uint32_t pc_increment = rs1_value == rs2_value ? imm_u : di.len;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// pc += (" << hex0x32(rs1_value) << " == " << hex0x32(rs2_value) << " ? " << hex0x32(imm_u) << " : " << uint32_t(di.len) << ") = " << hex0x32(pc_increment + pc);
 	}
 	pc += pc_increment;
 }
 
-void rv32i_hart::exec_addi(uint32_t insn, std::ostream* pos) {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+template<bool trace> void rv32i_hart::exec_addi(const decoded_insn& di) {
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_i = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 
 	uint32_t value = rs1_value + imm_i;
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " + " << to_hex0x32(imm_i) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " + " << hex0x32(imm_i) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_lbu(uint32_t insn, std::ostream* pos) {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+template<bool trace> void rv32i_hart::exec_lbu(const decoded_insn& di) {
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t addr = rs1_value + imm_u;
 	uint32_t data = mem.get8(addr);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = zx(m8(" << to_hex0x32(imm_u) << " + " << to_hex0x32(rs1_value) << ")) = " << to_hex0x32(data);
+	regs.set(rd, data);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = zx(m8(" << hex0x32(imm_u) << " + " << hex0x32(rs1_value) << ")) = " << hex0x32(data);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_lhu(uint32_t insn, std::ostream* pos) {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+template<bool trace> void rv32i_hart::exec_lhu(const decoded_insn& di) {
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t addr = rs1_value + imm_u;
 	uint32_t data = mem.get16(addr);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = zx(m8(" << to_hex0x32(imm_u) << " + " << to_hex0x32(rs1_value) << ")) = " << to_hex0x32(data);
+	regs.set(rd, data);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = zx(m8(" << hex0x32(imm_u) << " + " << hex0x32(rs1_value) << ")) = " << hex0x32(data);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos) {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+template<bool trace> void rv32i_hart::exec_lb(const decoded_insn& di) {
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t addr = rs1_value + imm_u;
 	uint32_t data = mem.get8_sx(addr);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = zx(m8(" << to_hex0x32(imm_u) << " + " << to_hex0x32(rs1_value) << ")) = " << to_hex0x32(data);
+	regs.set(rd, data);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = zx(m8(" << hex0x32(imm_u) << " + " << hex0x32(rs1_value) << ")) = " << hex0x32(data);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos) {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+template<bool trace> void rv32i_hart::exec_lh(const decoded_insn& di) {
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t addr = rs1_value + imm_u;
 	uint32_t data = mem.get16_sx(addr);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = zx(m8(" << to_hex0x32(imm_u) << " + " << to_hex0x32(rs1_value) << ")) = " << to_hex0x32(data);
+	regs.set(rd, data);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = zx(m8(" << hex0x32(imm_u) << " + " << hex0x32(rs1_value) << ")) = " << hex0x32(data);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_lw(uint32_t insn, std::ostream* pos) {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+template<bool trace> void rv32i_hart::exec_lw(const decoded_insn& di) {
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t addr = rs1_value + imm_u;
 	uint32_t data = mem.get32(addr);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = zx(m8(" << to_hex0x32(imm_u) << " + " << to_hex0x32(rs1_value) << ")) = " << to_hex0x32(data);
+	regs.set(rd, data);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = zx(m8(" << hex0x32(imm_u) << " + " << hex0x32(rs1_value) << ")) = " << hex0x32(data);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sb(uint32_t insn, std::ostream* pos) {
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_s(insn);
+template<bool trace> void rv32i_hart::exec_sb(const decoded_insn& di) {
+	uint32_t rs2 = di.rs2;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2) & 0x000000ff;
 	uint32_t addr = rs1_value + imm_u;
 	mem.set8(addr, rs2_value);
+	invalidate_icache(addr, 1);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// m8(" << to_hex0x32(rs1_value) << " + " << to_hex0x32(imm_u) << ") = " << to_hex0x32(rs2_value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// m8(" << hex0x32(rs1_value) << " + " << hex0x32(imm_u) << ") = " << hex0x32(rs2_value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sh(uint32_t insn, std::ostream* pos) {
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_s(insn);
+template<bool trace> void rv32i_hart::exec_sh(const decoded_insn& di) {
+	uint32_t rs2 = di.rs2;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2) & 0x0000ffff;
 	uint32_t addr = rs1_value + imm_u;
 	mem.set16(addr, rs2_value);
+	invalidate_icache(addr, 2);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// m8(" << to_hex0x32(rs1_value) << " + " << to_hex0x32(imm_u) << ") = " << to_hex0x32(rs2_value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// m8(" << hex0x32(rs1_value) << " + " << hex0x32(imm_u) << ") = " << hex0x32(rs2_value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sw(uint32_t insn, std::ostream* pos) {
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_s(insn);
+template<bool trace> void rv32i_hart::exec_sw(const decoded_insn& di) {
+	uint32_t rs2 = di.rs2;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2);
 	uint32_t addr = rs1_value + imm_u;
 	mem.set32(addr, rs2_value);
+	invalidate_icache(addr, 4);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// m8(" << to_hex0x32(rs1_value) << " + " << to_hex0x32(imm_u) << ") = " << to_hex0x32(rs2_value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// m8(" << hex0x32(rs1_value) << " + " << hex0x32(imm_u) << ") = " << hex0x32(rs2_value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_slti(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_slti(const decoded_insn& di)
 {
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
-	uint32_t rs1_value = regs.get(rs1);
+	int32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value < imm_u ? 1 : 0;
 
-	regs.set(rs2, value);
+	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rs2 << " = (" << to_hex0x32(rs1_value) << " < " << imm_u << ") ? 1 : 0 = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = (" << hex0x32(rs1_value) << " < " << imm_u << ") ? 1 : 0 = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sltiu(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_sltiu(const decoded_insn& di)
 {
-	uint32_t rs2 = get_rs2(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
-	int32_t rs1_value = regs.get(rs1);
-	uint32_t value = rs1 < imm_u ? 1 : 0;
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t value = rs1_value < (uint32_t)imm_u ? 1 : 0;
 
-	regs.set(rs2, value);
+	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rs2 << " = (" << to_hex0x32(rs1_value) << " <U " << imm_u << ") ? 1 : 0 = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = (" << hex0x32(rs1_value) << " <U " << imm_u << ") ? 1 : 0 = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_xori(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_xori(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value ^ imm_u;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " ^ " << to_hex0x32(imm_u) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " ^ " << hex0x32(imm_u) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_ori(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_ori(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value | imm_u;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " | " << to_hex0x32(imm_u) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " | " << hex0x32(imm_u) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_andi(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_andi(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value & imm_u;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " & " << to_hex0x32(imm_u) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " & " << hex0x32(imm_u) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_slli(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_slli(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value << imm_u;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " << " << imm_u << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " << " << imm_u << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_srli(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_srli(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value >> imm_u;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " >> " << imm_u << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " >> " << imm_u << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_srai(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_srai(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t imm_u = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	int32_t imm_u = di.imm;
 
 	int32_t rs1_value = regs.get(rs1);
 	uint32_t value = rs1_value >> imm_u;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " >> " << imm_u << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " >> " << imm_u << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_add(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_add(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
@@ -661,20 +1022,39 @@ void rv32i_hart::exec_add(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " + " << to_hex0x32(rs2_value) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " + " << hex0x32(rs2_value) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sll(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_sub(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	int32_t rs1_value = regs.get(rs1);
+	int32_t rs2_value = regs.get(rs2);
+	uint32_t value = rs1_value - rs2_value;
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " - " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_sll(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2) & 0b11111;
@@ -682,62 +1062,59 @@ void rv32i_hart::exec_sll(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " << " << rs2_value << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " << " << rs2_value << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_slt(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_slt(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
-	int32_t rs2_value = regs.get(rs2) & 0b11111;
+	int32_t rs2_value = regs.get(rs2);
 	uint32_t value = (rs1_value < rs2_value) ? 1 : 0;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = (" << to_hex0x32(rs1_value) << " < " << rs2_value << ") ? 1 : 0 = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = (" << hex0x32(rs1_value) << " < " << hex0x32(rs2_value) << ") ? 1 : 0 = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sltu(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_sltu(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	uint32_t rs1_value = regs.get(rs1);
-	uint32_t rs2_value = regs.get(rs2) & 0b11111;
+	uint32_t rs2_value = regs.get(rs2);
 	uint32_t value = (rs1_value < rs2_value) ? 1 : 0;
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = (" << to_hex0x32(rs1_value) << " <U " << rs2_value << ") ? 1 : 0 = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = (" << hex0x32(rs1_value) << " <U " << hex0x32(rs2_value) << ") ? 1 : 0 = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_xor(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_xor(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
@@ -745,20 +1122,19 @@ void rv32i_hart::exec_xor(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " ^ " << to_hex0x32(rs2_value) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " ^ " << hex0x32(rs2_value) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_srl(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_srl(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	uint32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2) & 0b11111;
@@ -766,20 +1142,19 @@ void rv32i_hart::exec_srl(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " >> " << rs2_value << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " >> " << rs2_value << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_sra(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_sra(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
 	uint32_t rs2_value = regs.get(rs2) & 0b11111;
@@ -787,20 +1162,19 @@ void rv32i_hart::exec_sra(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " >> " << rs2_value << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " >> " << rs2_value << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_or(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_or(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
@@ -808,20 +1182,19 @@ void rv32i_hart::exec_or(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " | " << to_hex0x32(rs2_value) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " | " << hex0x32(rs2_value) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_and(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_and(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
 	int32_t rs1_value = regs.get(rs1);
 	int32_t rs2_value = regs.get(rs2);
@@ -829,44 +1202,413 @@ void rv32i_hart::exec_and(uint32_t insn, std::ostream* pos)
 
 	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << to_hex0x32(rs1_value) << " & " << to_hex0x32(rs2_value) << " = " << to_hex0x32(value);
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " & " << hex0x32(rs2_value) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
-void rv32i_hart::exec_csrrs(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_mul(const decoded_insn& di)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t imm = get_imm_i(insn);
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
-	int32_t rs1_value = regs.get(rs1);
-	int32_t rd_value = regs.get(rd);
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	uint32_t value = rs1_value * rs2_value;
 
-	regs.set(rd, rs1_value);
+	regs.set(rd, value);
 
-	if (pos) {
-		std::string s = decode(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// x" << rd << " = " << rs1_value;
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " * " << hex0x32(rs2_value) << " = " << hex0x32(value);
 	}
 
-	pc += 4;
+	pc += di.len;
 }
 
+template<bool trace> void rv32i_hart::exec_mulh(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
 
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	uint32_t value = (int64_t(int32_t(rs1_value)) * int32_t(rs2_value)) >> 32;
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " *H " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_mulhsu(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	uint32_t value = (int64_t(int32_t(rs1_value)) * int64_t(rs2_value)) >> 32;
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " *HSU " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_mulhu(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	uint32_t value = (uint64_t(rs1_value) * rs2_value) >> 32;
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " *HU " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_div(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	// division by zero gives -1 and the one overflowing case gives the dividend
+	uint32_t value;
+	if (rs2_value == 0) value = -1;
+	else if (rs1_value == 0x80000000 && rs2_value == 0xffffffff) value = rs1_value;
+	else value = int32_t(rs1_value) / int32_t(rs2_value);
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " / " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_divu(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	uint32_t value = rs2_value ? rs1_value / rs2_value : 0xffffffff;
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " /U " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_rem(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	// the remainder of a division by zero is the dividend, and of the overflowing case 0
+	uint32_t value;
+	if (rs2_value == 0) value = rs1_value;
+	else if (rs1_value == 0x80000000 && rs2_value == 0xffffffff) value = 0;
+	else value = int32_t(rs1_value) % int32_t(rs2_value);
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " % " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_remu(const decoded_insn& di)
+{
+	uint32_t rd = di.rd;
+	uint32_t rs1 = di.rs1;
+	uint32_t rs2 = di.rs2;
+
+	uint32_t rs1_value = regs.get(rs1);
+	uint32_t rs2_value = regs.get(rs2);
+	uint32_t value = rs2_value ? rs1_value % rs2_value : rs1_value;
+
+	regs.set(rd, value);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << hex0x32(rs1_value) << " %U " << hex0x32(rs2_value) << " = " << hex0x32(value);
+	}
+
+	pc += di.len;
+}
+
+// Only the read-only mhartid is implemented, so any CSR instruction that
+// writes is illegal. csrrs and csrrc with rs1 = x0, and their immediate
+// forms with a zero immediate, only read; csrrw and csrrwi always write.
+template<bool trace> void rv32i_hart::exec_csr_read(const decoded_insn& di, bool writes)
+{
+	uint32_t rd = di.rd;
+	uint32_t csr = di.imm & 0xfff;
+
+	if (csr != csr_mhartid || writes) return exec_illegal_insn<trace>(di);
+
+	regs.set(rd, mhartid);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << rd << " = " << mhartid;
+	}
+
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_csrrw(const decoded_insn& di)
+{
+	exec_csr_read<trace>(di, true);
+}
+
+template<bool trace> void rv32i_hart::exec_csrrs(const decoded_insn& di)
+{
+	exec_csr_read<trace>(di, di.rs1 != 0);
+}
+
+template<bool trace> void rv32i_hart::exec_csrrc(const decoded_insn& di)
+{
+	exec_csr_read<trace>(di, di.rs1 != 0);
+}
+
+template<bool trace> void rv32i_hart::exec_csrrwi(const decoded_insn& di)
+{
+	exec_csr_read<trace>(di, true);
+}
+
+template<bool trace> void rv32i_hart::exec_csrrsi(const decoded_insn& di)
+{
+	exec_csr_read<trace>(di, di.rs1 != 0);
+}
+
+template<bool trace> void rv32i_hart::exec_csrrci(const decoded_insn& di)
+{
+	exec_csr_read<trace>(di, di.rs1 != 0);
+}
+
+// The word addressed by rs1 for an AMO, or nullptr after halting the hart
+// if it is misaligned or out of range. All AMOs are done as sequentially
+// consistent host atomics, which satisfies any combination of aq and rl.
+uint32_t* rv32i_hart::amo_word(const decoded_insn& di)
+{
+	uint32_t addr = regs.get(di.rs1);
+	uint32_t* p = mem.atomic_word(addr);
+	if (!p) {
+		halt = true;
+		halt_reason = "Misaligned or out of range atomic access at " + to_hex0x32(addr);
+	}
+	return p;
+}
+
+void rv32i_hart::trace_amo(const decoded_insn& di, uint32_t addr, uint32_t old, uint32_t val)
+{
+	trace_insn(pc, di.insn);
+	trace_line << "// x" << uint32_t(di.rd) << " = m32(" << hex0x32(addr) << ") = " << hex0x32(old)
+	     << ", m32(" << hex0x32(addr) << ") = " << hex0x32(val);
+}
+
+// AMOs without a host fetch-and-op are a compare-and-swap loop.
+template<bool trace, typename F> void rv32i_hart::exec_amo_cas(const decoded_insn& di, F op)
+{
+	uint32_t* p = amo_word(di);
+	if (!p) return;
+
+	uint32_t rs2_value = regs.get(di.rs2);
+	uint32_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+	uint32_t val;
+	do {
+		val = op(old, rs2_value);
+	} while (!__atomic_compare_exchange_n(p, &old, val, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	uint32_t addr = regs.get(di.rs1);
+	invalidate_icache(addr, 4);
+	regs.set(di.rd, old);
+	if constexpr (trace) trace_amo(di, addr, old, val);
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_lr_w(const decoded_insn& di)
+{
+	uint32_t* p = amo_word(di);
+	if (!p) return;
+
+	uint32_t addr = regs.get(di.rs1);
+	uint32_t data = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+	reserved = true;
+	reserved_addr = addr;
+	reserved_value = data;
+	regs.set(di.rd, data);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << uint32_t(di.rd) << " = m32(" << hex0x32(addr) << ") = " << hex0x32(data);
+	}
+
+	pc += di.len;
+}
+
+// The reservation is a copy of the loaded value rather than a watch on the
+// cache line: sc.w succeeds if the word still holds that value. That is
+// what lets it map onto a host compare-and-swap, at the cost of missing an
+// ABA change that another hart makes in between.
+template<bool trace> void rv32i_hart::exec_sc_w(const decoded_insn& di)
+{
+	uint32_t* p = amo_word(di);
+	if (!p) return;
+
+	uint32_t addr = regs.get(di.rs1);
+	uint32_t rs2_value = regs.get(di.rs2);
+	uint32_t expected = reserved_value;
+	bool ok = reserved && reserved_addr == addr
+		&& __atomic_compare_exchange_n(p, &expected, rs2_value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	reserved = false;
+	if (ok) invalidate_icache(addr, 4);
+	regs.set(di.rd, !ok);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// x" << uint32_t(di.rd) << " = " << !ok;
+		if (ok) trace_line << ", m32(" << hex0x32(addr) << ") = " << hex0x32(rs2_value);
+	}
+
+	pc += di.len;
+}
+
+// AMOs that map onto a host fetch-and-op. fetch returns the old value.
+template<bool trace, typename F> void rv32i_hart::exec_amo_fetch(const decoded_insn& di, F fetch)
+{
+	uint32_t* p = amo_word(di);
+	if (!p) return;
+
+	uint32_t addr = regs.get(di.rs1);
+	uint32_t old = fetch(p, regs.get(di.rs2));
+	invalidate_icache(addr, 4);
+	regs.set(di.rd, old);
+	if constexpr (trace) trace_amo(di, addr, old, __atomic_load_n(p, __ATOMIC_RELAXED));
+	pc += di.len;
+}
+
+template<bool trace> void rv32i_hart::exec_amoswap_w(const decoded_insn& di)
+{
+	exec_amo_fetch<trace>(di, [](uint32_t* p, uint32_t v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); });
+}
+
+template<bool trace> void rv32i_hart::exec_amoadd_w(const decoded_insn& di)
+{
+	exec_amo_fetch<trace>(di, [](uint32_t* p, uint32_t v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); });
+}
+
+template<bool trace> void rv32i_hart::exec_amoxor_w(const decoded_insn& di)
+{
+	exec_amo_fetch<trace>(di, [](uint32_t* p, uint32_t v) { return __atomic_fetch_xor(p, v, __ATOMIC_SEQ_CST); });
+}
+
+template<bool trace> void rv32i_hart::exec_amoand_w(const decoded_insn& di)
+{
+	exec_amo_fetch<trace>(di, [](uint32_t* p, uint32_t v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); });
+}
+
+template<bool trace> void rv32i_hart::exec_amoor_w(const decoded_insn& di)
+{
+	exec_amo_fetch<trace>(di, [](uint32_t* p, uint32_t v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); });
+}
+
+template<bool trace> void rv32i_hart::exec_amomin_w(const decoded_insn& di)
+{
+	exec_amo_cas<trace>(di, [](uint32_t a, uint32_t b) { return int32_t(a) < int32_t(b) ? a : b; });
+}
+
+template<bool trace> void rv32i_hart::exec_amomax_w(const decoded_insn& di)
+{
+	exec_amo_cas<trace>(di, [](uint32_t a, uint32_t b) { return int32_t(a) > int32_t(b) ? a : b; });
+}
+
+template<bool trace> void rv32i_hart::exec_amominu_w(const decoded_insn& di)
+{
+	exec_amo_cas<trace>(di, [](uint32_t a, uint32_t b) { return a < b ? a : b; });
+}
+
+template<bool trace> void rv32i_hart::exec_amomaxu_w(const decoded_insn& di)
+{
+	exec_amo_cas<trace>(di, [](uint32_t a, uint32_t b) { return a > b ? a : b; });
+}
+
+// Guest memory is accessed with plain host loads and stores, so a fence
+// only has to order the host accesses around it.
+template<bool trace> void rv32i_hart::exec_fence(const decoded_insn& di)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// fence";
+	}
+
+	pc += di.len;
+}
+
+// Stores from other harts do not invalidate this hart's icache or blocks,
+// so code written by another hart is only seen after a fence.i.
+template<bool trace> void rv32i_hart::exec_fence_i(const decoded_insn& di)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	invalidate_icache();
+
+	if constexpr (trace) {
+		trace_insn(pc, di.insn);
+		trace_line << "// fence.i";
+	}
+
+	pc += di.len;
+}
 
-void rv32i_hart::exec_illegal_insn(uint32_t insn, std::ostream* pos)
+template<bool trace> void rv32i_hart::exec_illegal_insn(const decoded_insn& di)
 {
-	(void) insn;
-	if (pos) {
-		std::string s = decode(0, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// ILLEGAL INSTRUCTION ";
+	if constexpr (trace) {
+		trace_insn(0, di.insn);
+		trace_line << "// ILLEGAL INSTRUCTION ";
 	}
 	halt = true;
 	halt_reason = "Illegal instruction ";
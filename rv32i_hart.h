@@ -1,93 +1,318 @@
 #include <string>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 #include "rv32i_decode.h"
 #include "registerfile.h"
+#include "rv32i_jit.h"
+#include "rv32i_predecode.h"
+#include "trace_log.h"
+#include "flow_trace.h"
+#include "profile.h"
+#include "stack_sampler.h"
+#include "cache_model.h"
 
 class rv32i_hart : public rv32i_decode
 {
 public:
-	rv32i_hart(memory& m) : mem(m) { show_instructions = false; show_registers = false; }
+	enum class engine { interpreter, threaded, jit };
+
+	// Everything about a hart that execution changes, apart from memory
+	// and the decode caches.
+	struct state
+	{
+		registerfile regs;
+		uint32_t pc;
+		uint64_t insn_counter;
+		bool halt;
+		std::string halt_reason;
+	};
+
+	rv32i_hart(memory& m) : mem(m), icache(icache_size) { show_instructions = false; show_registers = false; }
+	~rv32i_hart();
+	void set_engine(engine e) { exec_engine = e; }
 	void set_show_instructions(bool b) { show_instructions = b; }
 	void set_show_registers(bool b) { show_registers = b; }
+	// Log every instruction the interpreter executes to a binary trace in
+	// fname, which trace_log::render() turns into text later.
+	bool set_trace_file(const std::string& fname);
+	// Log branch outcomes and jalr targets to a flow trace in fname, from
+	// the current pc, for flow_trace::replay(). The jit engine runs as the
+	// threaded one meanwhile.
+	bool set_flow_file(const std::string& fname);
+	// Count executions per instruction kind and per pc. As with the flow
+	// trace, the jit engine runs as the threaded one meanwhile.
+	void set_profile(bool b);
+	const profile* get_profile() const { return prof.get(); }
+	// Keep a shadow call stack from the current pc and write it to fname
+	// as folded stacks, sampled every interval instructions. As with the
+	// flow trace, the jit engine runs as the threaded one meanwhile.
+	bool set_stack_file(const std::string& fname, uint64_t interval);
+	// Model an L1 instruction cache on every fetch and a data cache on
+	// every load, store and atomic, or not, for a null config. The block
+	// and jit engines step aside for the interpreter meanwhile.
+	void set_cache_models(const cache_model::config* i, const cache_model::config* d);
+	const cache_model* get_l1i() const { return l1i.get(); }
+	const cache_model* get_l1d() const { return l1d.get(); }
 	bool is_halted() const { return halt; }
 	const std::string& get_halt_reason() const { return halt_reason; }
 	uint64_t get_insn_counter() const { return insn_counter; }
 	void set_mhartid(int i) { mhartid = i; }
+	uint32_t get_mhartid() const { return mhartid; }
+	void set_pc(uint32_t addr) { pc = addr; }
+	uint32_t get_pc() const { return pc; }
 	void tick(const std::string& hdr = "");
+	void interpret(uint64_t exec_limit);
+	void run_blocks(uint64_t exec_limit);
+	void run_jit(uint64_t exec_limit);
 	void dump(const std::string& hdr = "") const;
 	void reset();
+	void invalidate_icache();
+	void invalidate_icache(uint32_t addr, uint32_t len);
+	// Decode icache misses in these ranges from their arrays. A range is
+	// dropped once this hart stores into it, or at any fence.i or full
+	// icache invalidation.
+	void set_predecoded(const std::vector<std::shared_ptr<const rv32i_predecode>>& p);
+	state save_state() const;
+	// Also drops any lr.w reservation. Decoded instructions are kept, so
+	// invalidate whatever memory has changed under them.
+	void restore_state(const state& s);
 
 private:
+	friend class rv32i_jit;
+
+	struct decoded_insn;
+	using handler = void (rv32i_hart::*)(const decoded_insn&);
+
+	// An instruction word with its operand fields already extracted.
+	// imm is sign-extended and pre-shifted for the format the handler expects.
+	// A compressed instruction is decoded as the instruction it expands to,
+	// with insn holding the original 16 bits and len set to 2.
+	struct decoded_insn
+	{
+		handler exec;
+		uint32_t insn;
+		int32_t imm;
+		uint8_t rd;
+		uint8_t rs1;
+		uint8_t rs2;
+		uint8_t len;
+		op o;
+	};
+
+	// Direct-mapped cache of predecoded instructions, tagged by pc and
+	// indexed by halfword.
+	struct icache_entry
+	{
+		uint32_t addr = { 0xffffffff };
+		decoded_insn di;
+	};
+
+	// A straight-line run of predecoded instructions ending at a branch,
+	// jal, jalr, ebreak or illegal instruction. link caches up to two
+	// successor blocks so that hot edges skip the block map lookup.
+	struct block
+	{
+		uint32_t addr;
+		// the address after the last instruction
+		uint32_t next;
+		std::vector<decoded_insn> insns;
+		block* link[2] = { nullptr, nullptr };
+		uint32_t hits = { 0 };
+	};
+
 	static constexpr int instruction_width = 35;
-	void exec(uint32_t insn, std::ostream*);
-	void exec_lui(uint32_t insn, std::ostream*);
-	void exec_auipc(uint32_t insn, std::ostream*);
-	void exec_jal(uint32_t insn, std::ostream*);
-	void exec_jalr(uint32_t insn, std::ostream*);
-	
-	void exec_bne(uint32_t insn, std::ostream*);
-	void exec_blt(uint32_t insn, std::ostream*);
-	void exec_bge(uint32_t insn, std::ostream*);
-	void exec_bltu(uint32_t insn, std::ostream*);
-	void exec_bgeu(uint32_t insn, std::ostream*);
-	void exec_beq(uint32_t insn, std::ostream*);
-	
-
-	void exec_addi(uint32_t insn, std::ostream* pos);
-
-
-	void exec_lbu(uint32_t insn, std::ostream* pos);
-	void exec_lhu(uint32_t insn, std::ostream* pos);
-	void exec_lb(uint32_t insn, std::ostream* pos);
-	void exec_lh(uint32_t insn, std::ostream* pos);
-	void exec_lw(uint32_t insn, std::ostream* pos);
-
-	void exec_sb(uint32_t insn, std::ostream* pos);
-	void exec_sh(uint32_t insn, std::ostream* pos);
-	void exec_sw(uint32_t insn, std::ostream* pos);
-
-	void exec_slti(uint32_t insn, std::ostream* pos);
-	void exec_sltiu(uint32_t insn, std::ostream* pos);
-	void exec_xori(uint32_t insn, std::ostream* pos);
-	void exec_ori(uint32_t insn, std::ostream* pos);
-	void exec_andi(uint32_t insn, std::ostream* pos);
-	void exec_slli(uint32_t insn, std::ostream* pos);
-	void exec_srli(uint32_t insn, std::ostream* pos);
-	void exec_srai(uint32_t insn, std::ostream* pos);
-
-	void exec_add(uint32_t insn, std::ostream* pos);
-	void exec_sub(uint32_t insn, std::ostream* pos);
-	void exec_sll(uint32_t insn, std::ostream* pos);
-	void exec_slt(uint32_t insn, std::ostream* pos);
-	void exec_sltu(uint32_t insn, std::ostream* pos);
-	void exec_xor(uint32_t insn, std::ostream* pos);
-	void exec_srl(uint32_t insn, std::ostream* pos);
-	void exec_sra(uint32_t insn, std::ostream* pos);
-	void exec_or(uint32_t insn, std::ostream* pos);
-	void exec_and(uint32_t insn, std::ostream* pos);
-
-
-	void exec_csrrs(uint32_t insn, std::ostream* pos);
-	void exec_csrrc(uint32_t insn, std::ostream* pos);
-	void exec_csrrw(uint32_t insn, std::ostream* pos);
-	void exec_csrrsi(uint32_t insn, std::ostream* pos);
-	void exec_csrrci(uint32_t insn, std::ostream* pos);
-	void exec_csrrwi(uint32_t insn, std::ostream* pos);
-
-
-	
-	void exec_illegal_insn(uint32_t insn, std::ostream*);
-	void exec_ebreak(uint32_t insn, std::ostream*);
+	static constexpr size_t trace_line_max = 256;
+	static constexpr uint32_t icache_invalid = 0xffffffff;
+	static constexpr uint32_t max_block_insns = 64;
+	static constexpr uint32_t code_page_shift = 12;
+	static constexpr uint32_t jit_threshold = 16;
+
+	// Every handler is instantiated twice. The trace instantiation writes
+	// the instruction and its effect to trace_os; the other has no trace
+	// code at all. The icache holds decodes for one of them at a time.
+	template<bool trace> static const handler handlers[];
+	template<bool trace> static decoded_insn predecode(uint32_t insn);
+	template<bool trace> static decoded_insn predecode(const rv32i_predecode& p, size_t i);
+	template<bool trace> decoded_insn decode_at(uint32_t addr) const;
+	void drop_predecoded(uint32_t addr, uint32_t len);
+	void trace_insn(uint32_t addr, uint32_t insn);
+	// For the flow trace, with pc already past an instruction of op o
+	// that would fall through to next
+	void log_flow(op o, uint32_t next)
+	{
+		if (o >= op::beq && o <= op::bgeu) flow_log->branch(pc != next);
+		else if (o == op::jalr) flow_log->jump(pc);
+	}
+	uint32_t fetch_insn(uint32_t addr) const;
+	const decoded_insn& fetch(uint32_t addr);
+	void set_icache_trace(bool trace);
+	// record feeds whichever of insn_log, flow_log, prof, stacks, l1i and
+	// l1d are set
+	template<bool trace_insns, bool trace_regs, bool record> void step();
+	template<bool trace_insns, bool trace_regs, bool record> void interpret(uint64_t exec_limit);
+	static bool is_block_end(const decoded_insn& di);
+	block* translate(uint32_t addr);
+	block* lookup_block(uint32_t addr);
+	block* link_block(block* from, uint32_t addr);
+	void exec_block(const block* b);
+	void profile_block(const block* b, size_t n);
+	void access_data(const decoded_insn& di);
+	// For the shadow call stack, with pc already past an instruction of
+	// op o that would fall through to next
+	void track_calls(op o, uint32_t rd, uint32_t rs1, uint32_t next)
+	{
+		auto link = [](uint32_t r) { return r == 1 || r == 5; };
+		if (o == op::jal) {
+			if (link(rd)) stacks->call(pc, next);
+		}
+		else if (o == op::jalr) {
+			if (link(rs1) && (!link(rd) || rd != rs1)) stacks->ret(pc);
+			if (link(rd)) stacks->call(pc, next);
+		}
+	}
+	void flush_blocks();
+
+	template<bool trace> void exec_lui(const decoded_insn& di);
+	template<bool trace> void exec_auipc(const decoded_insn& di);
+	template<bool trace> void exec_jal(const decoded_insn& di);
+	template<bool trace> void exec_jalr(const decoded_insn& di);
+
+	template<bool trace> void exec_bne(const decoded_insn& di);
+	template<bool trace> void exec_blt(const decoded_insn& di);
+	template<bool trace> void exec_bge(const decoded_insn& di);
+	template<bool trace> void exec_bltu(const decoded_insn& di);
+	template<bool trace> void exec_bgeu(const decoded_insn& di);
+	template<bool trace> void exec_beq(const decoded_insn& di);
+
+
+	template<bool trace> void exec_addi(const decoded_insn& di);
+
+
+	template<bool trace> void exec_lbu(const decoded_insn& di);
+	template<bool trace> void exec_lhu(const decoded_insn& di);
+	template<bool trace> void exec_lb(const decoded_insn& di);
+	template<bool trace> void exec_lh(const decoded_insn& di);
+	template<bool trace> void exec_lw(const decoded_insn& di);
+
+	template<bool trace> void exec_sb(const decoded_insn& di);
+	template<bool trace> void exec_sh(const decoded_insn& di);
+	template<bool trace> void exec_sw(const decoded_insn& di);
+
+	template<bool trace> void exec_slti(const decoded_insn& di);
+	template<bool trace> void exec_sltiu(const decoded_insn& di);
+	template<bool trace> void exec_xori(const decoded_insn& di);
+	template<bool trace> void exec_ori(const decoded_insn& di);
+	template<bool trace> void exec_andi(const decoded_insn& di);
+	template<bool trace> void exec_slli(const decoded_insn& di);
+	template<bool trace> void exec_srli(const decoded_insn& di);
+	template<bool trace> void exec_srai(const decoded_insn& di);
+
+	template<bool trace> void exec_add(const decoded_insn& di);
+	template<bool trace> void exec_sub(const decoded_insn& di);
+	template<bool trace> void exec_sll(const decoded_insn& di);
+	template<bool trace> void exec_slt(const decoded_insn& di);
+	template<bool trace> void exec_sltu(const decoded_insn& di);
+	template<bool trace> void exec_xor(const decoded_insn& di);
+	template<bool trace> void exec_srl(const decoded_insn& di);
+	template<bool trace> void exec_sra(const decoded_insn& di);
+	template<bool trace> void exec_or(const decoded_insn& di);
+	template<bool trace> void exec_and(const decoded_insn& di);
+
+	template<bool trace> void exec_mul(const decoded_insn& di);
+	template<bool trace> void exec_mulh(const decoded_insn& di);
+	template<bool trace> void exec_mulhsu(const decoded_insn& di);
+	template<bool trace> void exec_mulhu(const decoded_insn& di);
+	template<bool trace> void exec_div(const decoded_insn& di);
+	template<bool trace> void exec_divu(const decoded_insn& di);
+	template<bool trace> void exec_rem(const decoded_insn& di);
+	template<bool trace> void exec_remu(const decoded_insn& di);
+
+
+	template<bool trace> void exec_csr_read(const decoded_insn& di, bool writes);
+	template<bool trace> void exec_csrrs(const decoded_insn& di);
+	template<bool trace> void exec_csrrc(const decoded_insn& di);
+	template<bool trace> void exec_csrrw(const decoded_insn& di);
+	template<bool trace> void exec_csrrsi(const decoded_insn& di);
+	template<bool trace> void exec_csrrci(const decoded_insn& di);
+	template<bool trace> void exec_csrrwi(const decoded_insn& di);
+
+
+
+	uint32_t* amo_word(const decoded_insn& di);
+	void trace_amo(const decoded_insn& di, uint32_t addr, uint32_t old, uint32_t val);
+	template<bool trace, typename F> void exec_amo_fetch(const decoded_insn& di, F fetch);
+	template<bool trace, typename F> void exec_amo_cas(const decoded_insn& di, F op);
+
+	template<bool trace> void exec_lr_w(const decoded_insn& di);
+	template<bool trace> void exec_sc_w(const decoded_insn& di);
+	template<bool trace> void exec_amoswap_w(const decoded_insn& di);
+	template<bool trace> void exec_amoadd_w(const decoded_insn& di);
+	template<bool trace> void exec_amoxor_w(const decoded_insn& di);
+	template<bool trace> void exec_amoand_w(const decoded_insn& di);
+	template<bool trace> void exec_amoor_w(const decoded_insn& di);
+	template<bool trace> void exec_amomin_w(const decoded_insn& di);
+	template<bool trace> void exec_amomax_w(const decoded_insn& di);
+	template<bool trace> void exec_amominu_w(const decoded_insn& di);
+	template<bool trace> void exec_amomaxu_w(const decoded_insn& di);
+
+	template<bool trace> void exec_fence(const decoded_insn& di);
+	template<bool trace> void exec_fence_i(const decoded_insn& di);
+
+	template<bool trace> void exec_illegal_insn(const decoded_insn& di);
+	template<bool trace> void exec_ebreak(const decoded_insn& di);
 
 	bool halt = { false };
 	std::string halt_reason = { "none" };
-	
+
 	uint64_t insn_counter = { 0 };
 	uint32_t pc = { 0 };
 	uint32_t mhartid = { 0 };
+	std::ostream* trace_os = { &std::cout };
+	// Each traced instruction is formatted here, without allocating, and
+	// written to trace_os in one piece.
+	char trace_buf[trace_line_max];
+	text_buffer trace_line = { trace_buf, sizeof(trace_buf) };
+
+	// lr.w reservation: the word and the value it held
+	bool reserved = { false };
+	uint32_t reserved_addr = { 0 };
+	uint32_t reserved_value = { 0 };
 
 protected:
+	static constexpr uint32_t icache_size = 1 << 14;
+
+	void halt_hart(const std::string& reason) { halt = true; halt_reason = reason; }
+	// After a guest access faulted inside exec_block(), which counts its
+	// instructions only at the end, count those that ran up to and
+	// including the one at pc, as step() would have.
+	void count_faulted_block();
+
 	registerfile regs;
 	memory& mem;
 	bool show_instructions, show_registers;
+	std::unique_ptr<trace_log> insn_log;
+	std::unique_ptr<flow_trace> flow_log;
+	uint64_t flow_start = { 0 };
+	std::unique_ptr<profile> prof;
+	std::unique_ptr<stack_sampler> stacks;
+	std::unique_ptr<cache_model> l1i, l1d;
+	engine exec_engine = { engine::interpreter };
+	// created by run_jit() on first use
+	std::unique_ptr<rv32i_jit> jit;
+
+private:
+	std::vector<icache_entry> icache;
+	bool icache_trace = { false };
+
+	// predecoded code ranges, and the span they cover
+	std::vector<std::shared_ptr<const rv32i_predecode>> predecoded;
+	uint64_t predecoded_lo = { 0 }, predecoded_hi = { 0 };
 
-};
\ No newline at end of file
+	std::unordered_map<uint32_t, std::unique_ptr<block>> blocks;
+	std::vector<bool> code_pages;
+	bool blocks_stale = { false };
+	// the block exec_block() is in, for count_faulted_block()
+	const block* running = { nullptr };
+};
@@ -0,0 +1,559 @@
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include "rv32i_jit.h"
+#include "rv32i_hart.h"
+
+rv32i_jit::rv32i_jit(rv32i_hart* h, size_t size) : hart(h), size(size)
+{
+#if defined(__x86_64__)
+	void* m = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) return;
+	code = static_cast<uint8_t*>(m);
+	p = code;
+
+	// uint32_t entry(int32_t* regs, uint8_t* block, int64_t* budget)
+	// r15 holds the guest register file and r14 the remaining budget.
+	push(rbx); push(rbp); push(r12); push(r13); push(r14); push(r15);
+	push(rdx);
+	rex(true, rdi, r15); emit8(0x89); emit8(0xc0 | (rdi & 7) << 3 | (r15 & 7));	// mov r15, rdi
+	rex(true, r14, rdx); emit8(0x8b); emit8((r14 & 7) << 3 | rdx);			// mov r14, [rdx]
+	emit8(0xff); emit8(0xe6);							// jmp rsi
+
+	// every block exit lands here with the next guest pc in eax
+	exit_stub = p;
+	pop(rdx);
+	rex(true, r14, rdx); emit8(0x89); emit8((r14 & 7) << 3 | rdx);			// mov [rdx], r14
+	pop(r15); pop(r14); pop(r13); pop(r12); pop(rbp); pop(rbx);
+	emit8(0xc3);
+
+	code_start = p;
+#endif
+}
+
+rv32i_jit::~rv32i_jit()
+{
+	if (code) munmap(code, size);
+}
+
+uint8_t* rv32i_jit::lookup(uint32_t addr) const
+{
+	auto it = blocks.find(addr);
+	return it != blocks.end() ? it->second : nullptr;
+}
+
+uint32_t rv32i_jit::enter(uint8_t* block, int64_t& budget)
+{
+	using entry_fn = uint32_t (*)(int32_t*, uint8_t*, int64_t*);
+	return reinterpret_cast<entry_fn>(code)(hart->regs.registers, block, &budget);
+}
+
+void rv32i_jit::flush()
+{
+	blocks.clear();
+	pending_links.clear();
+	p = code_start;
+}
+
+bool rv32i_jit::is_branch(uint32_t insn)
+{
+	uint32_t opcode = get_opcode(insn);
+	return opcode == opcode_btype || opcode == opcode_jal || opcode == opcode_jalr;
+}
+
+// Only translate what rv32i_hart::predecode() would execute the same way.
+bool rv32i_jit::is_supported(uint32_t insn)
+{
+	op o = get_op(insn);
+	return o != op::illegal && o <= op::remu;
+}
+
+void rv32i_jit::emit32(uint32_t v)
+{
+	std::memcpy(p, &v, 4);
+	p += 4;
+}
+
+void rv32i_jit::emit64(uint64_t v)
+{
+	std::memcpy(p, &v, 8);
+	p += 8;
+}
+
+void rv32i_jit::rex(bool w, int r, int b)
+{
+	uint8_t prefix = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+	if (prefix != 0x40) emit8(prefix);
+}
+
+// <op> r/m32, r32 with a register operand
+void rv32i_jit::op_rr(uint8_t op, int rm, int r)
+{
+	rex(false, r, rm);
+	emit8(op);
+	emit8(0xc0 | (r & 7) << 3 | (rm & 7));
+}
+
+void rv32i_jit::mov_ri(int dst, uint32_t imm)
+{
+	rex(false, 0, dst);
+	emit8(0xb8 + (dst & 7));
+	emit32(imm);
+}
+
+void rv32i_jit::mov_ri64(int dst, uint64_t imm)
+{
+	rex(true, 0, dst);
+	emit8(0xb8 + (dst & 7));
+	emit64(imm);
+}
+
+// mov r32, [r15 + 4 * g]
+void rv32i_jit::mov_r_guest(int dst, uint32_t g)
+{
+	rex(false, dst, r15);
+	emit8(0x8b);
+	emit8(0x80 | (dst & 7) << 3 | (r15 & 7));
+	emit32(g * 4);
+}
+
+// mov [r15 + 4 * g], r32
+void rv32i_jit::mov_guest_r(uint32_t g, int src)
+{
+	rex(false, src, r15);
+	emit8(0x89);
+	emit8(0x80 | (src & 7) << 3 | (r15 & 7));
+	emit32(g * 4);
+}
+
+// group 1 ALU op (add /0, or /1, and /4, sub /5, xor /6, cmp /7) with imm32
+void rv32i_jit::alu_ri(int ext, int dst, uint32_t imm)
+{
+	rex(false, 0, dst);
+	emit8(0x81);
+	emit8(0xc0 | ext << 3 | (dst & 7));
+	emit32(imm);
+}
+
+// group 2 shift (shl /4, shr /5, sar /7)
+void rv32i_jit::shift_ri(int ext, int dst, uint8_t imm)
+{
+	rex(false, 0, dst);
+	emit8(0xc1);
+	emit8(0xc0 | ext << 3 | (dst & 7));
+	emit8(imm);
+}
+
+void rv32i_jit::shift_rcl(int ext, int dst)
+{
+	rex(false, 0, dst);
+	emit8(0xd3);
+	emit8(0xc0 | ext << 3 | (dst & 7));
+}
+
+// setcc al; movzx eax, al
+void rv32i_jit::setcc_eax(uint8_t cc)
+{
+	emit8(0x0f); emit8(0x90 + cc); emit8(0xc0);
+	emit8(0x0f); emit8(0xb6); emit8(0xc0);
+}
+
+void rv32i_jit::push(int r)
+{
+	rex(false, 0, r);
+	emit8(0x50 + (r & 7));
+}
+
+void rv32i_jit::pop(int r)
+{
+	rex(false, 0, r);
+	emit8(0x58 + (r & 7));
+}
+
+uint8_t* rv32i_jit::jcc(uint8_t cc)
+{
+	emit8(0x0f);
+	emit8(0x80 + cc);
+	uint8_t* site = p;
+	emit32(0);
+	return site;
+}
+
+uint8_t* rv32i_jit::jmp()
+{
+	emit8(0xe9);
+	uint8_t* site = p;
+	emit32(0);
+	return site;
+}
+
+void rv32i_jit::patch(uint8_t* rel32, const uint8_t* target)
+{
+	int32_t rel = target - (rel32 + 4);
+	std::memcpy(rel32, &rel, 4);
+}
+
+void rv32i_jit::read_guest(int dst, uint32_t g)
+{
+	if (g == 0) op_rr(0x31, dst, dst);
+	else if (host_of[g] >= 0) mov_rr(dst, host_of[g]);
+	else mov_r_guest(dst, g);
+}
+
+void rv32i_jit::write_guest(uint32_t g, int src)
+{
+	if (g == 0) return;
+	if (host_of[g] >= 0) {
+		mov_rr(host_of[g], src);
+		written[g] = true;
+	}
+	else {
+		mov_guest_r(g, src);
+	}
+}
+
+void rv32i_jit::write_back()
+{
+	for (uint32_t g = 1; g < 32; g++)
+		if (host_of[g] >= 0 && written[g]) mov_guest_r(g, host_of[g]);
+}
+
+// Call fn(hart, esi, edx) keeping the caller-saved guest registers alive.
+void rv32i_jit::call_helper(const void* fn)
+{
+	for (int r : caller_saved_in_use) push(r);
+	bool pad = caller_saved_in_use.size() & 1;
+	if (pad) { emit8(0x48); emit8(0x83); emit8(0xec); emit8(8); }	// sub rsp, 8
+
+	mov_ri64(rdi, reinterpret_cast<uint64_t>(hart));
+	mov_ri64(rax, reinterpret_cast<uint64_t>(fn));
+	emit8(0xff); emit8(0xd0);						// call rax
+
+	if (pad) { emit8(0x48); emit8(0x83); emit8(0xc4); emit8(8); }	// add rsp, 8
+	for (auto it = caller_saved_in_use.rbegin(); it != caller_saved_in_use.rend(); ++it) pop(*it);
+}
+
+// Leave the block for target, chaining straight to it when it is compiled.
+void rv32i_jit::exit_to(uint32_t target)
+{
+	write_back();
+
+	uint8_t* site = jmp();
+	uint8_t* native = lookup(target);
+	if (native) {
+		patch(site, native);
+		return;
+	}
+
+	patch(site, p);
+	pending_links[target].push_back(site);
+	mov_ri(rax, target);
+	patch(jmp(), exit_stub);
+}
+
+uint8_t* rv32i_jit::compile(uint32_t addr, const std::vector<uint32_t>& words)
+{
+	// expand compressed instructions; pcs[i] is where insns[i] starts
+	std::vector<uint32_t> insns, pcs = { addr };
+	for (uint32_t w : words) {
+		insns.push_back(is_compressed(w) ? expand_compressed(w) : w);
+		pcs.push_back(pcs.back() + (is_compressed(w) ? 2 : 4));
+	}
+
+	if (!code || insns.empty() || !is_supported(insns[0])) {
+		blocks[addr] = nullptr;
+		return nullptr;
+	}
+	if (is_full()) return nullptr;
+
+	uint32_t n = 0;
+	while (n < insns.size() && is_supported(insns[n])) {
+		if (is_branch(insns[n++])) break;
+	}
+
+	// give the most used guest registers a host register for the block
+	uint32_t uses[32] = { 0 };
+	for (uint32_t i = 0; i < n; i++) {
+		uses[get_rd(insns[i])]++;
+		uses[get_rs1(insns[i])]++;
+		uses[get_rs2(insns[i])]++;
+	}
+	uses[0] = 0;
+
+	static constexpr int pool[max_alloc] = { rbx, rbp, r12, r13, r8, r9, r10, r11 };
+	std::fill(std::begin(host_of), std::end(host_of), -1);
+	std::fill(std::begin(written), std::end(written), false);
+	caller_saved_in_use.clear();
+	for (int i = 0; i < max_alloc; i++) {
+		uint32_t g = std::max_element(std::begin(uses), std::end(uses)) - std::begin(uses);
+		if (uses[g] == 0) break;
+		uses[g] = 0;
+		host_of[g] = pool[i];
+		if (pool[i] >= r8) caller_saved_in_use.push_back(pool[i]);
+	}
+
+	uint8_t* entry = p;
+	blocks[addr] = entry;
+
+	// sub r14, n; jl out_of_budget
+	emit8(0x49); emit8(0x81); emit8(0xee); emit32(n);
+	uint8_t* budget_site = jcc(0xc);
+
+	for (uint32_t g = 1; g < 32; g++)
+		if (host_of[g] >= 0) mov_r_guest(host_of[g], g);
+
+	std::vector<early_exit> early;
+	for (uint32_t i = 0; i < n; i++)
+		emit_insn(pcs[i], pcs[i + 1], insns[i], n - i - 1, early);
+	if (!is_branch(insns[n - 1]))
+		exit_to(pcs[n]);
+
+	patch(budget_site, p);
+	emit8(0x49); emit8(0x81); emit8(0xc6); emit32(n);	// add r14, n
+	mov_ri(rax, addr);
+	patch(jmp(), exit_stub);
+
+	for (const early_exit& s : early) {
+		patch(s.site, p);
+		emit8(0x49); emit8(0x81); emit8(0xc6); emit32(s.skipped);
+		write_back();
+		mov_ri(rax, s.next_pc);
+		patch(jmp(), exit_stub);
+	}
+
+	auto it = pending_links.find(addr);
+	if (it != pending_links.end()) {
+		for (uint8_t* site : it->second) patch(site, entry);
+		pending_links.erase(it);
+	}
+	return entry;
+}
+
+// With reserved memory, leave the block in front of the instruction at addr
+// if the len byte access at esi is out of range, so that exec_block() or
+// the interpreter runs it and takes the fault rather than native code.
+void rv32i_jit::check_range(uint32_t addr, uint32_t len, uint32_t skipped, std::vector<early_exit>& early)
+{
+	if (!hart->mem.host_base()) return;
+	uint64_t size = hart->mem.get_size();
+	alu_ri(7, rsi, size >= len ? uint32_t(size - len) : 0);	// cmp esi, size - len
+	early.push_back({ jcc(size >= len ? 0x7 : 0x3), skipped + 1, addr });	// ja / jae
+}
+
+void rv32i_jit::emit_insn(uint32_t addr, uint32_t next, uint32_t insn, uint32_t skipped, std::vector<early_exit>& early)
+{
+	uint32_t rd = get_rd(insn);
+	uint32_t rs1 = get_rs1(insn);
+	uint32_t rs2 = get_rs2(insn);
+	uint32_t funct3 = get_funct3(insn);
+	bool alt = get_funct7(insn) == 0b0100000;
+
+	switch (get_opcode(insn)) {
+	case opcode_lui:
+		mov_ri(rax, get_imm_u(insn) << 12);
+		write_guest(rd, rax);
+		return;
+
+	case opcode_auipc:
+		mov_ri(rax, addr + (get_imm_u(insn) << 12));
+		write_guest(rd, rax);
+		return;
+
+	case opcode_jal:
+		mov_ri(rax, next);
+		write_guest(rd, rax);
+		exit_to(addr + get_imm_j(insn));
+		return;
+
+	case opcode_jalr:
+		read_guest(rax, rs1);
+		alu_ri(0, rax, get_imm_i(insn));
+		alu_ri(4, rax, 0xfffffffe);
+		mov_ri(rcx, next);
+		write_guest(rd, rcx);
+		write_back();
+		patch(jmp(), exit_stub);
+		return;
+
+	case opcode_btype:
+	{
+		static constexpr uint8_t cc[8] = { 0x4, 0x5, 0, 0, 0xc, 0xd, 0x2, 0x3 };
+		read_guest(rax, rs1);
+		read_guest(rcx, rs2);
+		op_rr(0x39, rax, rcx);
+		uint8_t* taken = jcc(cc[funct3]);
+		exit_to(next);
+		patch(taken, p);
+		exit_to(addr + get_imm_b(insn));
+		return;
+	}
+
+	case opcode_load_imm:
+	{
+		static const void* const fn[8] = {
+			reinterpret_cast<const void*>(&load_lb), reinterpret_cast<const void*>(&load_lh),
+			reinterpret_cast<const void*>(&load_lw), nullptr,
+			reinterpret_cast<const void*>(&load_lbu), reinterpret_cast<const void*>(&load_lhu),
+		};
+		read_guest(rax, rs1);
+		alu_ri(0, rax, get_imm_i(insn));
+		mov_rr(rsi, rax);
+		check_range(addr, 1 << (funct3 & 3), skipped, early);
+		if (uint8_t* base = hart->mem.host_base()) {
+			// With the whole address space reserved a load is a single
+			// host access; out of range addresses fault in the host.
+			static constexpr uint8_t ext[8] = { 0xbe, 0xbf, 0x8b, 0, 0xb6, 0xb7 };
+			mov_ri64(rdx, reinterpret_cast<uint64_t>(base));
+			if (funct3 != funct3_lw) emit8(0x0f);
+			emit8(ext[funct3]); emit8(0x04); emit8(0x32);	// mov/movsx/movzx eax, [rdx + rsi]
+		}
+		else {
+			call_helper(fn[funct3]);
+		}
+		write_guest(rd, rax);
+		return;
+	}
+
+	case opcode_stype:
+	{
+		static const void* const fn[3] = {
+			reinterpret_cast<const void*>(&store_sb), reinterpret_cast<const void*>(&store_sh),
+			reinterpret_cast<const void*>(&store_sw),
+		};
+		read_guest(rax, rs1);
+		alu_ri(0, rax, get_imm_s(insn));
+		read_guest(rdx, rs2);
+		mov_rr(rsi, rax);
+		check_range(addr, 1 << funct3, skipped, early);
+		call_helper(fn[funct3]);
+		emit8(0x84); emit8(0xc0);					// test al, al
+		early.push_back({ jcc(0x5), skipped, next });
+		return;
+	}
+
+	case opcode_alu_imm:
+	{
+		int32_t imm = get_imm_i(insn);
+		read_guest(rax, rs1);
+		switch (funct3) {
+		case funct3_add: alu_ri(0, rax, imm); break;
+		case funct3_xor: alu_ri(6, rax, imm); break;
+		case funct3_or: alu_ri(1, rax, imm); break;
+		case funct3_and: alu_ri(4, rax, imm); break;
+		case funct3_slt: alu_ri(7, rax, imm); setcc_eax(0xc); break;
+		case funct3_sltu: alu_ri(7, rax, imm); setcc_eax(0x2); break;
+		case funct3_sll: shift_ri(4, rax, imm & 0x1f); break;
+		case funct3_srx: shift_ri(alt ? 7 : 5, rax, imm & 0x1f); break;
+		}
+		write_guest(rd, rax);
+		return;
+	}
+
+	case opcode_rtype:
+		read_guest(rax, rs1);
+		read_guest(rcx, rs2);
+		if (get_funct7(insn) == funct7_muldiv) {
+			emit_muldiv(funct3);
+			write_guest(rd, rax);
+			return;
+		}
+		switch (funct3) {
+		case funct3_add: op_rr(alt ? 0x29 : 0x01, rax, rcx); break;
+		case funct3_xor: op_rr(0x31, rax, rcx); break;
+		case funct3_or: op_rr(0x09, rax, rcx); break;
+		case funct3_and: op_rr(0x21, rax, rcx); break;
+		case funct3_slt: op_rr(0x39, rax, rcx); setcc_eax(0xc); break;
+		case funct3_sltu: op_rr(0x39, rax, rcx); setcc_eax(0x2); break;
+		case funct3_sll: shift_rcl(4, rax); break;
+		case funct3_srx: shift_rcl(alt ? 7 : 5, rax); break;
+		}
+		write_guest(rd, rax);
+		return;
+	}
+}
+
+// eax = eax <op> ecx for RV32M. The high multiplies use a 64-bit imul on
+// sign- or zero-extended operands; division by zero and the signed
+// overflow case branch around the x86 divide, which would trap.
+void rv32i_jit::emit_muldiv(uint32_t funct3)
+{
+	static constexpr uint8_t movsxd_rax[3] = { 0x48, 0x63, 0xc0 };
+	static constexpr uint8_t movsxd_rcx[3] = { 0x48, 0x63, 0xc9 };
+	static constexpr uint8_t imul_rax_rcx[4] = { 0x48, 0x0f, 0xaf, 0xc1 };
+
+	switch (funct3) {
+	case funct3_mul:
+		emit8(0x0f); emit8(0xaf); emit8(0xc1);				// imul eax, ecx
+		return;
+	case funct3_mulh:
+	case funct3_mulhsu:
+	case funct3_mulhu:
+		if (funct3 != funct3_mulhu) for (uint8_t b : movsxd_rax) emit8(b);
+		if (funct3 == funct3_mulh) for (uint8_t b : movsxd_rcx) emit8(b);
+		for (uint8_t b : imul_rax_rcx) emit8(b);
+		emit8(0x48); emit8(0xc1); emit8(0xe8); emit8(32);		// shr rax, 32
+		return;
+	}
+
+	bool is_signed = funct3 == funct3_div || funct3 == funct3_rem;
+	bool is_rem = funct3 == funct3_rem || funct3 == funct3_remu;
+
+	emit8(0x85); emit8(0xc9);						// test ecx, ecx
+	uint8_t* by_zero = jcc(0x4);
+	uint8_t* overflow = nullptr;
+	if (is_signed) {
+		emit8(0x83); emit8(0xf9); emit8(0xff);				// cmp ecx, -1
+		uint8_t* divide = jcc(0x5);
+		emit8(0x3d); emit32(0x80000000);				// cmp eax, INT32_MIN
+		overflow = jcc(0x4);
+		patch(divide, p);
+		emit8(0x99);							// cdq
+		emit8(0xf7); emit8(0xf9);					// idiv ecx
+	}
+	else {
+		op_rr(0x31, rdx, rdx);
+		emit8(0xf7); emit8(0xf1);					// div ecx
+	}
+	if (is_rem) mov_rr(rax, rdx);
+	uint8_t* done = jmp();
+
+	// x / 0 = -1 and x % 0 = x
+	patch(by_zero, p);
+	if (!is_rem) mov_ri(rax, 0xffffffff);
+
+	// INT32_MIN / -1 = INT32_MIN and INT32_MIN % -1 = 0
+	if (overflow) {
+		uint8_t* skip = jmp();
+		patch(overflow, p);
+		if (is_rem) op_rr(0x31, rax, rax);
+		patch(skip, p);
+	}
+	patch(done, p);
+}
+
+uint32_t rv32i_jit::load_lb(rv32i_hart* h, uint32_t addr) { return h->mem.get8_sx(addr); }
+uint32_t rv32i_jit::load_lh(rv32i_hart* h, uint32_t addr) { return h->mem.get16_sx(addr); }
+uint32_t rv32i_jit::load_lw(rv32i_hart* h, uint32_t addr) { return h->mem.get32(addr); }
+uint32_t rv32i_jit::load_lbu(rv32i_hart* h, uint32_t addr) { return h->mem.get8(addr); }
+uint32_t rv32i_jit::load_lhu(rv32i_hart* h, uint32_t addr) { return h->mem.get16(addr); }
+
+bool rv32i_jit::store_sb(rv32i_hart* h, uint32_t addr, uint32_t val)
+{
+	h->mem.set8(addr, val);
+	h->invalidate_icache(addr, 1);
+	return h->blocks_stale;
+}
+
+bool rv32i_jit::store_sh(rv32i_hart* h, uint32_t addr, uint32_t val)
+{
+	h->mem.set16(addr, val);
+	h->invalidate_icache(addr, 2);
+	return h->blocks_stale;
+}
+
+bool rv32i_jit::store_sw(rv32i_hart* h, uint32_t addr, uint32_t val)
+{
+	h->mem.set32(addr, val);
+	h->invalidate_icache(addr, 4);
+	return h->blocks_stale;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "rv32i_decode.h"
+
+class rv32i_hart;
+
+// Translates hot RV32I basic blocks into x86-64 code.
+//
+// Up to max_alloc guest registers per block are held in host registers
+// and written back at every block exit. Direct branch and jal targets are
+// chained by patching the exit jump once the target has been compiled;
+// jalr, stores that hit translated code and an exhausted instruction
+// budget return to the dispatcher in rv32i_hart::run_jit(). A block is
+// cut short in front of any instruction the JIT does not handle so that
+// the interpreter executes it.
+class rv32i_jit : public rv32i_decode
+{
+public:
+	static constexpr size_t code_size = 16 << 20;
+	static constexpr size_t max_block_code = 64 << 10;
+
+	// size is the bytes of native code held at once; at least
+	// max_block_code more than the entry and exit stubs
+	rv32i_jit(rv32i_hart* h, size_t size = code_size);
+	~rv32i_jit();
+
+	bool is_available() const { return code != nullptr; }
+
+	// True when the next block might not fit; flush() before compiling.
+	bool is_full() const { return p + max_block_code > code + size; }
+
+	// Return native code for the block at addr, or nullptr.
+	uint8_t* lookup(uint32_t addr) const;
+
+	// Compile the given instructions (starting at addr), as fetched: a
+	// compressed one is 16 bits wide. Returns nullptr if the first
+	// instruction cannot be translated, or if is_full().
+	uint8_t* compile(uint32_t addr, const std::vector<uint32_t>& words);
+
+	// Run native code until it exits. budget is the number of instructions
+	// that may still be executed and is decremented as blocks are entered.
+	// Returns the guest pc to continue at.
+	uint32_t enter(uint8_t* block, int64_t& budget);
+
+	void flush();
+
+private:
+	enum reg { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+	// A store that may have modified translated code leaves the block
+	// early, and so does an access out of range of reserved memory, to
+	// fault outside native code. skipped instructions go back on the
+	// budget.
+	struct early_exit
+	{
+		uint8_t* site;
+		uint32_t skipped;
+		uint32_t next_pc;
+	};
+
+	static constexpr int max_alloc = 8;
+
+	static bool is_supported(uint32_t insn);
+	static bool is_branch(uint32_t insn);
+
+	void emit8(uint8_t b) { *p++ = b; }
+	void emit32(uint32_t v);
+	void emit64(uint64_t v);
+	void rex(bool w, int r, int b);
+	void op_rr(uint8_t op, int rm, int r);
+	void mov_rr(int dst, int src) { op_rr(0x89, dst, src); }
+	void mov_ri(int dst, uint32_t imm);
+	void mov_ri64(int dst, uint64_t imm);
+	void mov_r_guest(int dst, uint32_t g);
+	void mov_guest_r(uint32_t g, int src);
+	void alu_ri(int ext, int dst, uint32_t imm);
+	void shift_ri(int ext, int dst, uint8_t imm);
+	void shift_rcl(int ext, int dst);
+	void setcc_eax(uint8_t cc);
+	void push(int r);
+	void pop(int r);
+	uint8_t* jcc(uint8_t cc);
+	uint8_t* jmp();
+	void patch(uint8_t* rel32, const uint8_t* target);
+
+	void read_guest(int dst, uint32_t g);
+	void write_guest(uint32_t g, int src);
+	void write_back();
+	void call_helper(const void* fn);
+	void exit_to(uint32_t target);
+	void emit_muldiv(uint32_t funct3);
+	void check_range(uint32_t addr, uint32_t len, uint32_t skipped, std::vector<early_exit>& early);
+	void emit_insn(uint32_t addr, uint32_t next, uint32_t insn, uint32_t skipped, std::vector<early_exit>& early);
+
+	static uint32_t load_lb(rv32i_hart* h, uint32_t addr);
+	static uint32_t load_lh(rv32i_hart* h, uint32_t addr);
+	static uint32_t load_lw(rv32i_hart* h, uint32_t addr);
+	static uint32_t load_lbu(rv32i_hart* h, uint32_t addr);
+	static uint32_t load_lhu(rv32i_hart* h, uint32_t addr);
+	static bool store_sb(rv32i_hart* h, uint32_t addr, uint32_t val);
+	static bool store_sh(rv32i_hart* h, uint32_t addr, uint32_t val);
+	static bool store_sw(rv32i_hart* h, uint32_t addr, uint32_t val);
+
+	rv32i_hart* hart;
+	size_t size;
+	uint8_t* code = { nullptr };
+	uint8_t* code_start = { nullptr };
+	uint8_t* exit_stub = { nullptr };
+	uint8_t* p = { nullptr };
+
+	std::unordered_map<uint32_t, uint8_t*> blocks;
+	std::unordered_map<uint32_t, std::vector<uint8_t*>> pending_links;
+
+	// per-block register allocation state used while emitting
+	int host_of[32];
+	bool written[32];
+	std::vector<int> caller_saved_in_use;
+};
@@ -0,0 +1,133 @@
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "rv32i_predecode.h"
+#include "memory.h"
+
+rv32i_predecode::rv32i_predecode(const memory& mem, uint32_t addr, uint64_t len) : end(uint64_t(addr) + len)
+{
+	uint64_t first = (uint64_t(addr) + 3) & ~uint64_t(3);
+	size_t n = first < end ? (end - first) / 4 : 0;
+	start = first;
+
+	insn.resize(n);
+	ops.resize(n);
+	opcode.resize(n);
+	rd.resize(n);
+	rs1.resize(n);
+	rs2.resize(n);
+	imm_i.resize(n);
+	imm_s.resize(n);
+	imm_b.resize(n);
+	imm_u.resize(n);
+	imm_j.resize(n);
+
+	mem.copy_out(start, reinterpret_cast<uint8_t*>(insn.data()), uint64_t(n) * 4);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	for (uint32_t& w : insn) w = __builtin_bswap32(w);
+#endif
+
+	size_t done = 0;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2")) done = split_avx2();
+#endif
+	split(done);
+	for (size_t i = 0; i < n; i++) ops[i] = get_op(insn[i]);
+}
+
+// The entries from from on, one word at a time
+void rv32i_predecode::split(size_t from)
+{
+	for (size_t i = from; i < insn.size(); i++) {
+		uint32_t w = insn[i];
+		opcode[i] = get_opcode(w);
+		rd[i] = get_rd(w);
+		rs1[i] = get_rs1(w);
+		rs2[i] = get_rs2(w);
+		imm_i[i] = get_imm_i(w);
+		imm_s[i] = get_imm_s(w);
+		imm_b[i] = get_imm_b(w);
+		imm_u[i] = get_imm_u(w) << 12;
+		imm_j[i] = get_imm_j(w);
+	}
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static inline __m256i mask(__m256i v, int32_t m)
+{
+	return _mm256_and_si256(v, _mm256_set1_epi32(m));
+}
+
+__attribute__((target("avx2"))) static inline __m256i or4(__m256i a, __m256i b, __m256i c, __m256i d)
+{
+	return _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+}
+
+// Each get_imm_* as shifts and masks on eight words. The byte fields are
+// packed into one word per instruction, then transposed so that each
+// field's eight bytes are contiguous. Returns the number of entries done.
+__attribute__((target("avx2"))) size_t rv32i_predecode::split_avx2()
+{
+	const __m256i transpose = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+		0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	const __m256i interleave = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	size_t i = 0;
+	for (; i + 8 <= insn.size(); i += 8) {
+		__m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&insn[i]));
+
+		__m256i f = _mm256_or_si256(_mm256_or_si256(mask(w, 0x7f), mask(_mm256_slli_epi32(w, 1), 0x1f1f00)),
+			mask(_mm256_slli_epi32(w, 4), 0x1f000000));
+		f = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(f, transpose), interleave);
+		uint64_t b[4] = { uint64_t(_mm256_extract_epi64(f, 0)), uint64_t(_mm256_extract_epi64(f, 1)),
+			uint64_t(_mm256_extract_epi64(f, 2)), uint64_t(_mm256_extract_epi64(f, 3)) };
+		std::memcpy(&opcode[i], &b[0], 8);
+		std::memcpy(&rd[i], &b[1], 8);
+		std::memcpy(&rs1[i], &b[2], 8);
+		std::memcpy(&rs2[i], &b[3], 8);
+
+		__m256i rd_bits = mask(_mm256_srli_epi32(w, 7), 0x1f);
+		__m256i i_imm = _mm256_srai_epi32(w, 20);
+		__m256i s_imm = _mm256_or_si256(mask(i_imm, ~0x1f), rd_bits);
+		__m256i b_imm = or4(mask(_mm256_srai_epi32(w, 19), ~0xfff), mask(_mm256_srli_epi32(w, 20), 0x7e0),
+			mask(rd_bits, 0x1e), mask(_mm256_slli_epi32(w, 4), 0x800));
+		__m256i u_imm = mask(w, ~0xfff);
+		__m256i j_imm = or4(mask(_mm256_srai_epi32(w, 11), ~0xfffff), mask(w, 0xff000),
+			mask(_mm256_srli_epi32(w, 9), 0x800), mask(_mm256_srli_epi32(w, 20), 0x7fe));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&imm_i[i]), i_imm);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&imm_s[i]), s_imm);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&imm_b[i]), b_imm);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&imm_u[i]), u_imm);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&imm_j[i]), j_imm);
+	}
+	return i;
+}
+#endif
+
+void rv32i_predecode::disassemble(std::ostream& os, const memory& mem) const
+{
+	char buf[32 + decode_max];
+	text_buffer line(buf, sizeof(buf));
+	for (uint64_t a = start; a < end; ) {
+		uint32_t addr = a;
+		line.clear();
+		line << hex32(addr) << ": ";
+		if (covers(addr) && !is_compressed(insn[index(addr)])) {
+			size_t i = index(addr);
+			line << hex32(insn[i]) << "  ";
+			render(line, addr, insn[i], ops[i]);
+			a += 4;
+		}
+		else {
+			uint32_t w = mem.get16(addr);
+			if (!is_compressed(w)) w |= uint32_t(mem.get16(addr + 2)) << 16;
+			if (is_compressed(w)) line << "    " << hex16(w) << "  ";
+			else line << hex32(w) << "  ";
+			decode(line, addr, w);
+			a += is_compressed(w) ? 2 : 4;
+		}
+		line << '\n';
+		os.write(line.data(), line.size());
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include "rv32i_decode.h"
+
+class memory;
+
+// A code range decoded ahead of time into one array per field, so that a
+// pass over a large image is limited by memory bandwidth rather than by
+// field extraction. With AVX2 the fields of eight words are extracted at
+// once.
+//
+// Entry i describes the word at get_start() + 4 * i taken as a 32-bit
+// instruction. Compressed instructions, and 32-bit ones that are not word
+// aligned, are left to the usual decoders. The arrays hold memory as it
+// was when the range was decoded, so anyone reading them must stop once
+// the range is written.
+class rv32i_predecode : public rv32i_decode
+{
+public:
+	rv32i_predecode(const memory& mem, uint32_t addr, uint64_t len);
+
+	uint32_t get_start() const { return start; }
+	uint64_t get_end() const { return end; }
+	bool covers(uint32_t addr) const { return (addr & 3) == 0 && addr >= start && addr - start < 4 * insn.size(); }
+	size_t index(uint32_t addr) const { return (addr - start) >> 2; }
+
+	// Write one line per instruction in the range, as the instruction
+	// trace shows them.
+	void disassemble(std::ostream& os, const memory& mem) const;
+
+	std::vector<uint32_t> insn;
+	std::vector<op> ops;
+	std::vector<uint8_t> opcode, rd, rs1, rs2;
+	// imm_u is shifted into place, as lui writes it
+	std::vector<int32_t> imm_i, imm_s, imm_b, imm_u, imm_j;
+
+private:
+	size_t split_avx2();
+	void split(size_t from);
+
+	uint32_t start;
+	uint64_t end;
+};
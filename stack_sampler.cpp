@@ -0,0 +1,78 @@
+#include <iostream>
+#include <algorithm>
+#include "stack_sampler.h"
+#include "memory.h"
+
+stack_sampler::stack_sampler(const std::string& fname, const memory& mem, uint64_t interval, uint32_t start_pc,
+	uint64_t insns) : os(fname), mem(mem), interval(std::max<uint64_t>(interval, 1))
+{
+	if (!os) std::cout << "Can't open file '" << fname << "' for writing" << std::endl;
+	next = (insns / this->interval + 1) * this->interval;
+	frames.push_back({ start_pc, 0xffffffff });
+}
+
+stack_sampler::~stack_sampler()
+{
+	if (os) write();
+}
+
+// Pop to the frame that returns to target, so that a longjmp unwinds
+// every frame it skips. A return that matches no frame pops one. The
+// root frame stays.
+void stack_sampler::ret(uint32_t target)
+{
+	if (lost) {
+		lost--;
+		return;
+	}
+	for (size_t i = frames.size(); i-- > 1; ) {
+		if (frames[i].ret == target) {
+			frames.resize(i);
+			return;
+		}
+	}
+	if (frames.size() > 1) frames.pop_back();
+}
+
+// The block engines tick once a block, which may pass several sample
+// points; each counts, as it would have one instruction at a time.
+void stack_sampler::sample(uint32_t pc, uint64_t insns)
+{
+	std::vector<uint32_t> key;
+	key.reserve(frames.size() + 1);
+	for (const frame& f : frames) key.push_back(f.entry);
+	key.push_back(pc);
+	samples[key] += (insns - next) / interval + 1;
+	next = (insns / interval + 1) * interval;
+}
+
+void stack_sampler::write()
+{
+	const std::vector<memory::symbol>& syms = mem.get_symbols();
+	auto find = [&](uint32_t addr) -> const memory::symbol* {
+		auto it = std::upper_bound(syms.begin(), syms.end(), addr,
+			[](uint32_t a, const memory::symbol& s) { return a < s.addr; });
+		if (it == syms.begin()) return nullptr;
+		--it;
+		return it->size && addr - it->addr >= it->size ? nullptr : &*it;
+	};
+
+	// samples whose stacks name the same functions are one line
+	std::map<std::string, uint64_t> folded;
+	for (const auto& s : samples) {
+		std::string stack;
+		std::string name;
+		for (size_t i = 0; i + 1 < s.first.size(); i++) {
+			const memory::symbol* sym = find(s.first[i]);
+			name = sym ? sym->name : to_hex0x32(s.first[i]);
+			if (i) stack += ';';
+			stack += name;
+		}
+		if (!syms.empty()) {
+			const memory::symbol* sym = find(s.first.back());
+			if (sym && sym->name != name) stack += ';' + sym->name;
+		}
+		folded[stack] += s.second;
+	}
+	for (const auto& f : folded) os << f.first << ' ' << f.second << '\n';
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include "hex.h"
+
+class memory;
+
+// A shadow call stack kept from jal and jalr, taking x1 and x5 as link
+// registers as the return-address stack hints in the ISA manual do, and
+// sampled every interval instructions. When it is destroyed it writes the
+// samples as folded stacks, "root;caller;callee count" per line, as
+// flamegraph tools read them. A frame is named by the symbol its function
+// entry falls in, or by the entry address when there are no symbols; with
+// symbols the function the sampled pc is in ends the stack too, which
+// catches tail calls.
+class stack_sampler : public hex
+{
+public:
+	// Check is_open() before use
+	stack_sampler(const std::string& fname, const memory& mem, uint64_t interval, uint32_t start_pc, uint64_t insns);
+	~stack_sampler();
+	stack_sampler(const stack_sampler&) = delete;
+	stack_sampler& operator=(const stack_sampler&) = delete;
+
+	bool is_open() const { return os.is_open(); }
+
+	void call(uint32_t target, uint32_t ret)
+	{
+		if (frames.size() < max_depth) frames.push_back({ target, ret });
+		else lost++;
+	}
+	void ret(uint32_t target);
+
+	// once insns has gone past the next sample point
+	void tick(uint32_t pc, uint64_t insns)
+	{
+		if (insns >= next) sample(pc, insns);
+	}
+
+private:
+	static constexpr size_t max_depth = 4096;
+
+	struct frame
+	{
+		uint32_t entry;
+		uint32_t ret;
+	};
+
+	void sample(uint32_t pc, uint64_t insns);
+	void write();
+
+	std::ofstream os;
+	const memory& mem;
+	uint64_t interval;
+	uint64_t next;
+	std::vector<frame> frames;
+	// calls past max_depth, for their returns to match
+	uint64_t lost = { 0 };
+	// function entries from the root, then the sampled pc
+	std::map<std::vector<uint32_t>, uint64_t> samples;
+};
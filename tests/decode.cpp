@@ -0,0 +1,34 @@
+// Checks the jal offsets that rv32i_decode extracts, at both ends of the
+// range and around the bits that move in the J-type encoding.
+//
+// Build from this directory with
+//	g++ -std=c++17 -O2 -pthread -o decode decode.cpp $(ls ../*.cpp | grep -v main.cpp)
+
+#include <iostream>
+#include <string>
+#include "../rv32i_decode.h"
+
+static bool check(uint32_t insn, const std::string& want)
+{
+	std::string got = rv32i_decode::decode(0, insn);
+	if (got == want) return true;
+	std::cout << hex::to_hex0x32(insn) << " decodes as \"" << got << "\", not \"" << want << "\"" << std::endl;
+	return false;
+}
+
+int main()
+{
+	bool ok = true;
+
+	// the sign is insn bit 31, and imm bit 11 is insn bit 20
+	ok &= check(0x800ff06f, "jal     x0,0xfffff000");	// jal x0,-4096
+	ok &= check(0x801ff06f, "jal     x0,0xfffff800");	// jal x0,-2048
+	ok &= check(0xffdff0ef, "jal     x1,0xfffffffc");	// jal x1,-4
+	ok &= check(0xfffff06f, "jal     x0,0xfffffffe");	// jal x0,-2
+	ok &= check(0x8000006f, "jal     x0,0xfff00000");	// jal x0,-1048576
+	ok &= check(0x0010006f, "jal     x0,0x00000800");	// jal x0,2048
+	ok &= check(0x7ffff2ef, "jal     x5,0x000ffffe");	// jal x5,1048574
+
+	std::cout << (ok ? "pass" : "FAIL") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// Runs small programs on each engine, with each memory backing, and checks
+// that the threaded and jit engines stop where the interpreter does, with
+// the same registers.
+//
+// Build from this directory with
+//	g++ -std=c++17 -O2 -pthread -o engine_parity engine_parity.cpp $(ls ../*.cpp | grep -v main.cpp)
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include "../cpu_single_hart.h"
+
+struct result
+{
+	std::string halt_reason;
+	uint64_t insns;
+	uint32_t pc;
+	std::vector<int32_t> regs;
+};
+
+static result run(const std::vector<uint32_t>& prog, memory::backing b, rv32i_hart::engine e)
+{
+	memory mem(0x10000, b);
+	for (size_t i = 0; i < prog.size(); i++) mem.set32(4 * i, prog[i]);
+	cpu_single_hart cpu(mem);
+	cpu.set_engine(e);
+	cpu.execute(10000);
+
+	rv32i_hart::state s = cpu.save_state();
+	result r = { s.halt_reason, s.insn_counter, s.pc, {} };
+	for (uint32_t i = 0; i < 32; i++) r.regs.push_back(s.regs.get(i));
+	return r;
+}
+
+static bool check(const std::string& name, const std::vector<uint32_t>& prog)
+{
+	static const char* const names[] = { "interpreter", "threaded", "jit" };
+	static const char* const backings[] = { "paged", "reserved" };
+	bool ok = true;
+	for (int b = 0; b < 2; b++) {
+		result want = run(prog, memory::backing(b), rv32i_hart::engine::interpreter);
+		for (int e = 1; e < 3; e++) {
+			result got = run(prog, memory::backing(b), rv32i_hart::engine(e));
+			if (got.halt_reason != want.halt_reason || got.insns != want.insns || got.pc != want.pc
+			    || got.regs != want.regs) {
+				std::cout << name << ", " << backings[b] << ": " << names[e] << " stopped at "
+					<< hex::to_hex0x32(got.pc) << " after " << got.insns << " (" << got.halt_reason << "), the interpreter at " << hex::to_hex0x32(want.pc)
+					<< " after " << want.insns << " (" << want.halt_reason << ")" << std::endl;
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+
+	// amoadd.w on a misaligned address halts in the middle of a block
+	ok &= check("misaligned amo", {
+		0x00200093,	// addi x1,x0,2
+		0x0000a1af,	// amoadd.w x3,x0,(x1)
+		0x00700293,	// addi x5,x0,7
+		0x00100073,	// ebreak
+	});
+
+	// so does a csr write, which only reads of mhartid support
+	ok &= check("csr write", {
+		0x00100093,	// addi x1,x0,1
+		0xf1409073,	// csrrw x0,mhartid,x1
+		0x00700293,	// addi x5,x0,7
+		0x00100073,	// ebreak
+	});
+
+	// a load past the end of memory in a block hot enough to be compiled,
+	// which faults with the reserved backing
+	ok &= check("load fault", {
+		0x0c800093,	// addi x1,x0,200
+		0x00010137,	// lui x2,0x10
+		0xda810113,	// addi x2,x2,-600
+		0x00118193,	// addi x3,x3,1
+		0x00012283,	// lw x5,0(x2)
+		0x00410113,	// addi x2,x2,4
+		0xfff08093,	// addi x1,x1,-1
+		0xfe0098e3,	// bne x1,x0,-16
+		0x00100073,	// ebreak
+	});
+
+	// a jump past the end of memory, which must not fault in instruction
+	// fetch or block translation
+	ok &= check("jump out of range", {
+		0x000200b7,	// lui x1,0x20
+		0x00008067,	// jalr x0,0(x1)
+	});
+
+	std::cout << (ok ? "pass" : "FAIL") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+// Writes a flow trace of a short loop, then replays it whole and cut off
+// in the middle of a packet, as a run that did not finish leaves it.
+//
+// Build from this directory with
+//	g++ -std=c++17 -O2 -pthread -o flow_replay flow_replay.cpp $(ls ../*.cpp | grep -v main.cpp)
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include "../cpu_single_hart.h"
+
+static const char* const fname = "flow_replay.tmp";
+
+// Replay fname over mem, and check that it succeeds with lines lines
+static bool check(const std::string& name, const memory& mem, size_t lines)
+{
+	std::ostringstream os;
+	bool ok = flow_trace::replay(fname, mem, os);
+	std::string text = os.str();
+	size_t got = std::count(text.begin(), text.end(), '\n');
+	if (ok && got == lines) return true;
+	std::cout << name << ": replay " << (ok ? "gave " : "failed after ") << got << " lines, not " << lines << std::endl;
+	return false;
+}
+
+int main()
+{
+	// 99 taken branches and one not taken: a full packet of 64 outcomes,
+	// all ones, then 36 more
+	std::vector<uint32_t> prog = {
+		0x06400093,	// addi x1,x0,100
+		0xfff08093,	// addi x1,x1,-1
+		0xfe009ee3,	// bne x1,x0,-4
+		0x00100073,	// ebreak
+	};
+	memory mem(0x10000);
+	for (size_t i = 0; i < prog.size(); i++) mem.set32(4 * i, prog[i]);
+	{
+		cpu_single_hart cpu(mem);
+		if (!cpu.set_flow_file(fname)) return 1;
+		cpu.execute(10000);
+	}
+
+	bool ok = check("whole trace", mem, 202);
+
+	// drop the end packet and the last two bytes of the packet before it,
+	// which leaves a byte of 0xff where the end packet would have started
+	std::vector<char> data;
+	{
+		std::ifstream in(fname, std::ios::binary);
+		data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	data.resize(data.size() - 9 - 2);
+	if (uint8_t(data[data.size() - 9]) != 0xff) {
+		std::cout << "the trace does not end as expected" << std::endl;
+		ok = false;
+	}
+	{
+		std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+		out.write(data.data(), data.size());
+	}
+	// the first addi, then 64 times round the loop, up to the bne that
+	// has no outcome
+	ok &= check("cut-off trace", mem, 1 + 64 * 2 + 1);
+
+	std::remove(fname);
+	std::cout << (ok ? "pass" : "FAIL") << std::endl;
+	return ok ? 0 : 1;
+}
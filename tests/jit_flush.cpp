@@ -0,0 +1,99 @@
+// Runs a hot loop, then enough other hot code to fill a small jit, then
+// the first loop again, and checks that the loop gets native code again
+// after the jit has been flushed.
+//
+// Build from this directory with
+//	g++ -std=c++17 -O2 -pthread -o jit_flush jit_flush.cpp $(ls ../*.cpp | grep -v main.cpp)
+
+#include <iostream>
+#include <vector>
+#include "../cpu_single_hart.h"
+
+// A hart whose jit holds only a few blocks at a time
+class small_jit_hart : public cpu_single_hart
+{
+public:
+	small_jit_hart(memory& mem) : cpu_single_hart(mem)
+	{
+		jit = std::make_unique<rv32i_jit>(this, rv32i_jit::max_block_code + 4096);
+	}
+	bool has_jit() const { return jit->is_available(); }
+	bool is_native(uint32_t addr) const { return jit->lookup(addr) != nullptr; }
+};
+
+static uint32_t addi(uint32_t rd, uint32_t rs1, int32_t imm)
+{
+	return uint32_t(imm) << 20 | rs1 << 15 | rd << 7 | 0x13;
+}
+
+static uint32_t branch(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t offset)
+{
+	uint32_t o = offset;
+	return (o >> 12 & 1) << 31 | (o >> 5 & 0x3f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12
+		| (o >> 1 & 0xf) << 8 | (o >> 11 & 1) << 7 | 0x63;
+}
+
+static uint32_t jal(uint32_t rd, int32_t offset)
+{
+	uint32_t o = offset;
+	return (o >> 20 & 1) << 31 | (o >> 1 & 0x3ff) << 21 | (o >> 11 & 1) << 20 | (o >> 12 & 0xff) << 12
+		| rd << 7 | 0x6f;
+}
+
+int main()
+{
+	static constexpr uint32_t pass = 0x0c, loop = 0x10, filler = 0x2c;
+	static constexpr uint32_t beq = 0b000, bne = 0b001;
+
+	// the loop 32 times, 48 filler blocks 20 times, then the loop again
+	std::vector<uint32_t> prog = {
+		addi(5, 0, 2),		// 0x00
+		addi(6, 0, 0),		// 0x04
+		addi(7, 0, 0),		// 0x08
+		addi(1, 0, 32),		// 0x0c pass:
+		addi(6, 6, 1),		// 0x10 loop:
+		addi(1, 1, -1),		// 0x14
+		branch(bne, 1, 0, -8),	// 0x18 bne x1,x0,loop
+		addi(5, 5, -1),		// 0x1c
+		branch(bne, 5, 0, 8),	// 0x20 bne x5,x0,0x28
+		0x00100073,		// 0x24 ebreak
+		addi(4, 0, 20),		// 0x28
+	};
+	// each filler block compiles to a few hundred bytes, so 48 of them
+	// overflow the jit at least once
+	for (int b = 0; b < 48; b++) {
+		for (int i = 0; i < 63; i++) prog.push_back(addi(7, 7, 1));
+		prog.push_back(jal(0, 4));
+	}
+	// the filler is too long for a branch back over it
+	uint32_t end = 4 * prog.size();
+	prog.push_back(addi(4, 4, -1));
+	prog.push_back(branch(beq, 4, 0, 8));
+	prog.push_back(jal(0, filler - (end + 8)));
+	prog.push_back(jal(0, pass - (end + 12)));
+
+	memory mem(0x10000);
+	for (size_t i = 0; i < prog.size(); i++) mem.set32(4 * i, prog[i]);
+	small_jit_hart cpu(mem);
+	cpu.set_engine(rv32i_hart::engine::jit);
+	if (!cpu.has_jit()) {
+		std::cout << "skipped: no jit on this host" << std::endl;
+		return 0;
+	}
+	cpu.execute(1000000);
+
+	rv32i_hart::state s = cpu.save_state();
+	bool ok = true;
+	if (s.halt_reason != "EBREAK instruction" || s.regs.get(6) != 64 || s.regs.get(7) != 20 * 48 * 63) {
+		std::cout << "stopped at " << hex::to_hex0x32(s.pc) << " (" << s.halt_reason << ") with x6 "
+			<< s.regs.get(6) << " and x7 " << s.regs.get(7) << std::endl;
+		ok = false;
+	}
+	if (!cpu.is_native(loop)) {
+		std::cout << "the loop was not compiled again after the jit was flushed" << std::endl;
+		ok = false;
+	}
+
+	std::cout << (ok ? "pass" : "FAIL") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "hex.h"
+
+// Formats text into a caller-supplied char array, with the << of an
+// ostream but no allocation, locale or manipulator state. Text that does
+// not fit is dropped. The array is not NUL-terminated.
+class text_buffer
+{
+public:
+	text_buffer(char* buf, size_t size) : start(buf), p(buf), end(buf + size) {}
+
+	const char* data() const { return start; }
+	size_t size() const { return p - start; }
+	void clear() { p = start; }
+
+	// Append spaces up to column width, if the text is shorter
+	void pad(size_t width)
+	{
+		while (size() < width && p != end) *p++ = ' ';
+	}
+
+	text_buffer& write(const char* s, size_t n)
+	{
+		n = std::min<size_t>(n, end - p);
+		std::memcpy(p, s, n);
+		p += n;
+		return *this;
+	}
+
+	text_buffer& operator<<(char c)
+	{
+		if (p != end) *p++ = c;
+		return *this;
+	}
+	text_buffer& operator<<(const char* s) { return write(s, std::strlen(s)); }
+	text_buffer& operator<<(bool b) { return *this << char('0' + b); }
+	text_buffer& operator<<(uint32_t i) { return *this << uint64_t(i); }
+	text_buffer& operator<<(int32_t i);
+	text_buffer& operator<<(uint64_t i);
+
+	text_buffer& operator<<(hex::hex8 h) { char b[2]; return write(b, hex::put_hex8(b, h.i) - b); }
+	text_buffer& operator<<(hex::hex16 h) { char b[4]; return write(b, hex::put_hex16(b, h.i) - b); }
+	text_buffer& operator<<(hex::hex32 h) { char b[8]; return write(b, hex::put_hex32(b, h.i) - b); }
+	text_buffer& operator<<(hex::hex0x32 h) { char b[10] = { '0', 'x' }; return write(b, hex::put_hex32(b + 2, h.i) - b); }
+	text_buffer& operator<<(hex::hex0x20 h) { char b[7]; return write(b, hex::put_hex0x20(b, h.i) - b); }
+	text_buffer& operator<<(hex::hex0x12 h) { char b[5]; return write(b, hex::put_hex0x12(b, h.i) - b); }
+
+private:
+	char* start;
+	char* p;
+	char* end;
+};
+
+inline text_buffer& text_buffer::operator<<(uint64_t i)
+{
+	char b[20];
+	char* q = b + sizeof(b);
+	do {
+		*--q = '0' + i % 10;
+		i /= 10;
+	} while (i);
+	return write(q, b + sizeof(b) - q);
+}
+
+inline text_buffer& text_buffer::operator<<(int32_t i)
+{
+	if (i < 0) *this << '-';
+	return *this << (i < 0 ? 0u - uint32_t(i) : uint32_t(i));
+}
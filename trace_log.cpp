@@ -0,0 +1,107 @@
+#include <iostream>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "trace_log.h"
+
+trace_log::trace_log(const std::string& fname) : ring(capacity)
+{
+	f = std::fopen(fname.c_str(), "wb");
+	if (!f) {
+		std::cout << "Can't open file '" << fname << "' for writing" << std::endl;
+		return;
+	}
+	std::fwrite(magic, sizeof(magic), 1, f);
+	writer = std::thread(&trace_log::drain, this);
+}
+
+trace_log::~trace_log()
+{
+	if (!f) return;
+	done.store(true, std::memory_order_release);
+	writer.join();
+	std::fclose(f);
+}
+
+// The ring is full: wait for the writer rather than drop records
+void trace_log::wait_for_space(uint64_t h)
+{
+	while (h - (tail_seen = tail.load(std::memory_order_acquire)) == capacity) std::this_thread::yield();
+}
+
+// Write out whatever has been appended, as contiguous runs of the ring,
+// until the owner is done and the ring is empty.
+void trace_log::drain()
+{
+	uint64_t t = tail.load(std::memory_order_relaxed);
+	for (;;) {
+		uint64_t h = head.load(std::memory_order_acquire);
+		if (h == t) {
+			if (done.load(std::memory_order_acquire)) {
+				if (head.load(std::memory_order_acquire) == t) break;
+				continue;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+		uint64_t n = std::min(h - t, capacity - (t & (capacity - 1)));
+		std::fwrite(&ring[t & (capacity - 1)], sizeof(record), n, f);
+		t += n;
+		tail.store(t, std::memory_order_release);
+	}
+	std::fflush(f);
+}
+
+bool trace_log::writes_rd(op o)
+{
+	switch (op_infos[size_t(o)].fmt) {
+	case format::lui: case format::auipc: case format::jal: case format::jalr: case format::load:
+	case format::alu_imm: case format::shift_imm: case format::rtype: case format::csr: case format::csri:
+	case format::amo:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool trace_log::render(const std::string& fname, std::ostream& os)
+{
+	static constexpr int instruction_width = 35;
+
+	std::FILE* in = std::fopen(fname.c_str(), "rb");
+	if (!in) {
+		std::cout << "Can't open file '" << fname << "' for reading" << std::endl;
+		return false;
+	}
+	char m[sizeof(magic)];
+	if (std::fread(m, sizeof(m), 1, in) != 1 || std::memcmp(m, magic, sizeof(magic)) != 0) {
+		std::cout << "'" << fname << "' is not a binary trace" << std::endl;
+		std::fclose(in);
+		return false;
+	}
+
+	std::vector<record> recs(4096);
+	std::vector<char> out(recs.size() * (64 + decode_max));
+	size_t n;
+	while ((n = std::fread(recs.data(), sizeof(record), recs.size(), in)) != 0) {
+		text_buffer text(out.data(), out.size());
+		for (size_t i = 0; i < n; i++) {
+			const record& r = recs[i];
+			text << hex32(r.pc) << ": ";
+			if (is_compressed(r.insn)) text << "    " << hex16(r.insn);
+			else text << hex32(r.insn);
+			text << "  ";
+			size_t at = text.size();
+			decode(text, r.pc, r.insn);
+			uint32_t word = is_compressed(r.insn) ? expand_compressed(r.insn) : r.insn;
+			if (word && get_rd(word) && writes_rd(get_op(word))) {
+				text.pad(at + instruction_width);
+				text << "// x" << get_rd(word) << " = " << hex0x32(r.value);
+			}
+			text << '\n';
+		}
+		os.write(text.data(), text.size());
+	}
+	std::fclose(in);
+	return true;
+}
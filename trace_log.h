@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdio>
+#include <cstdint>
+#include "rv32i_decode.h"
+
+// A binary instruction trace: one fixed-size record per instruction,
+// appended by the hart into a single-producer single-consumer ring and
+// written to a file by a thread of its own, so that the hart neither
+// formats text nor waits on the file unless the ring fills up. render()
+// turns a trace file into the text of the instruction trace afterwards.
+//
+// The file starts with magic and holds records in host byte order.
+class trace_log : public rv32i_decode
+{
+public:
+	struct record
+	{
+		uint32_t pc;
+		uint32_t insn;
+		// rd after the instruction; not meaningful for formats without rd
+		uint32_t value;
+	};
+
+	// Check is_open() before use; the writer thread only runs if it is.
+	explicit trace_log(const std::string& fname);
+	~trace_log();
+	trace_log(const trace_log&) = delete;
+	trace_log& operator=(const trace_log&) = delete;
+
+	bool is_open() const { return f != nullptr; }
+
+	void append(uint32_t pc, uint32_t insn, uint32_t value)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h - tail_seen == capacity) wait_for_space(h);
+		ring[h & (capacity - 1)] = { pc, insn, value };
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// Write the trace in fname to os as the instruction trace shows it,
+	// from the instruction words alone. Returns false if it is not a trace.
+	static bool render(const std::string& fname, std::ostream& os);
+
+private:
+	static constexpr uint64_t capacity = 1 << 16;
+	static constexpr char magic[8] = { 'R', 'V', '3', '2', 'T', 'R', 'C', '1' };
+
+	void wait_for_space(uint64_t h);
+	void drain();
+	static bool writes_rd(op o);
+
+	std::FILE* f = { nullptr };
+	std::vector<record> ring;
+	// producer and consumer positions, on cache lines of their own
+	alignas(64) std::atomic<uint64_t> head = { 0 };
+	uint64_t tail_seen = { 0 };
+	alignas(64) std::atomic<uint64_t> tail = { 0 };
+	std::atomic<bool> done = { false };
+	std::thread writer;
+};